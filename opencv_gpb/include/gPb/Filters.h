@@ -152,6 +152,13 @@ namespace cv
 		   int num_bins,
 		   std::vector<cv::Mat> & gradients);
 
+  //-----------------------------------------------
+  void
+  jointBilateralUpsample(const cv::Mat & coarse,
+			 const cv::Mat & guide,
+			 cv::Mat & output,
+			 double sigma_r);
+
   //-----------------------------------------------
   void 
   parallel_for_gradient_hist_2D(const cv::Mat & label,
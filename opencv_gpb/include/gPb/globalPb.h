@@ -1,21 +1,88 @@
 #include <iostream>
 #include <vector>
 #include <math.h>
+#include <string.h>
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
 #include <opencv2/core/core.hpp>
 
+// globalPb flags
+// keep the per-channel gradients and the sPb stack as bfloat16 (CV_16UC1)
+// between stages, widening to float only where they are consumed; each
+// stored value is off by at most 2^-8 of itself.  gPb_ori stays float, as
+// it is returned to callers that read it as CV_32FC1 (contour2ucm), and so
+// do the eigenvectors: they live only until sPb is filtered from them, and
+// at 17 planes they are a small part of the eigensolver peak
+#define GPB_HALF_STORAGE 1
+// compute the r=10 and r=20 histogram gradients on a 2x downsampled label
+// image with halved radii, then upsample them edge-aware
+#define GPB_APPROX_MPB   2
+// keep the sPb affinity as per-pixel stencil weights (no column indices)
+// and apply it matrix-free in the eigensolver
+#define GPB_STENCIL_W    4
+// keep only the upper triangle of the CSR affinity and multiply with a
+// symmetric kernel (ignored with GPB_STENCIL_W)
+#define GPB_SYMMETRIC_W  8
+// solve the sPb eigenproblem with the in-tree LOBPCG solver instead of
+// ARPACK, preconditioned by multigrid on the pixel grid ...
+#define GPB_LOBPCG       16
+// ... or by the Jacobi preconditioner
+#define GPB_LOBPCG_JACOBI 32
+// run ARPACK for the largest eigenpairs of the normalized affinity
+// D^-1/2 W D^-1/2 ("LA") instead of the smallest of the Laplacian ("SM")
+#define GPB_NCUT_LA      64
+// solve the sPb eigenproblem on 4x and then 2x max-pooled mPb first and
+// start each finer solve from the upsampled coarse eigenvectors
+#define GPB_WARM_START   128
+// memory-lean eigensolve: float eigenvectors and LOBPCG search space, a
+// 2*nev+1 vector ARPACK basis
+#define GPB_LEAN_NCUT    256
+// sPb from the eigenvectors' responses to a separable basis of the
+// oriented derivative filters, steered to the 8 orientations in one pass
+#define GPB_STEERED_SPB  512
+// solve the sPb eigenproblem on a graph of watershed superpixels of mPb
+// and lift the eigenvectors back to the pixels, blending only across weak
+// boundaries
+#define GPB_SUPERPIXEL_SPB 1024
+// drop sPb affinities below 1e-3 and stop the intervening contours at the
+// boundary strength that gives them (CSR storages only)
+#define GPB_SPARSE_W     2048
+// add 8 random affinities per pixel out to 15 pixels, past the disc
+// (CSR storages only)
+#define GPB_LONG_RANGE_W 4096
+// solve the sPb eigenproblem with PARPACK on row strips of the image, one
+// per MPI rank; needs a GPB_MPI build (make mpi) and more than one rank,
+// with every rank but 0 in sPb_worker()
+#define GPB_DISTRIBUTED_SPB 8192
+// anytime sPb: LOBPCG stops after a few seconds, or once further
+// eigenvectors would add little to sPb, and sPb uses the converged ones
+#define GPB_ANYTIME_SPB  16384
+
 namespace cv
 {
+  // max_memory_mb caps the sPb eigensolver allocations (0: none), as
+  // NCutOptions::max_memory_mb: fewer eigenvectors are sought when the
+  // lean settings do not fit, and if not even two fit an error is logged
+  // and sPb is zero
   void 
   globalPb(const cv::Mat & image,
 	   cv::Mat & gPb,
 	   cv::Mat & gPb_thin,
-	   vector<cv::Mat> & gPb_ori);
+	   vector<cv::Mat> & gPb_ori,
+	   int flags = 0,
+	   double max_memory_mb = 0.0);
+
+  void
+  lab_quantize(const vector<cv::Mat> & layers,
+	       int num_bins,
+	       vector<cv::Mat> & labels,
+	       cv::Mat & grey);
 
   void
   pb_parts_final_selected(vector<cv::Mat> & layers,
-			  vector<vector<cv::Mat> > & gradients);
+			  vector<vector<cv::Mat> > & gradients,
+			  const bool* active = NULL,
+			  int flags = 0);
   
   void 
   MakeFilter(const int radii,
@@ -25,5 +92,16 @@ namespace cv
   void
   multiscalePb(const cv::Mat & image,
 	       cv::Mat & mPb_max,
-	       vector<vector<cv::Mat> > & gradients);   
+	       vector<vector<cv::Mat> > & gradients,
+	       int flags = 0);   
+
+#ifdef GPB_MPI
+  // the ranks but 0 serve the strip solves of GPB_DISTRIBUTED_SPB until
+  // rank 0 calls sPb_release_workers()
+  void
+  sPb_worker();
+
+  void
+  sPb_release_workers();
+#endif
 }
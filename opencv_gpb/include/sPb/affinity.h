@@ -24,11 +24,39 @@
 
 namespace Group
 {
+    //
+    // probability of same segment given the max-accumulated pb ic
+    //
+    float C_IC_SS(float ic);
+
     //
     // compute similarities for a subset of an image given by mask
     //
     void computeAffinities2(const SupportMap& ic, const float sigma, const float dthresh, SMatrix** affinity);
 
+    //
+    // same affinities in matrix-free form, no column indices stored
+    //
+    void computeAffinitiesStencil(const SupportMap& ic, const float sigma, const float dthresh, StencilMatrix** affinity);
+
+    //
+    // the same straight from the boundaries: intervening contours out to
+    // radius wr and affinities in one parallel pass, without a SupportMap
+    //
+    void computeAffinities2(const DualLattice& boundaries, const int wr, const float thresh,
+                            const float sigma, const float dthresh, SMatrix** affinity);
+    void computeAffinitiesStencil(const DualLattice& boundaries, const int wr, const float thresh,
+                                  const float sigma, const float dthresh, StencilMatrix** affinity);
+
+    //
+    // add count random links per pixel between dthresh and radius to a
+    // symmetric CSR affinity, keeping those of affinity >= epsilon
+    // (none if radius <= dthresh)
+    //
+    void addLongRangeAffinities(const DualLattice& boundaries, const int count, const int radius,
+                                const float sigma, const float dthresh, const float epsilon,
+                                SMatrix** affinity);
+
 } //namespace Group
 
 #endif 
@@ -20,6 +20,10 @@
 #define ARRAY_HH
 
 #include <assert.h>
+#include <stddef.h>
+#include <algorithm>
+#include <new>
+#include <vector>
 
 // TODO: 
 // - replace asserts with exceptions?
@@ -40,11 +44,74 @@
 // doesn't copy the array contents but since it's const you won't accidentaly
 // resize or delete it...
 //
+// Array1D and Array2D can also be views of memory they do not own (which
+// they leave alone when destroyed or resized), or take their elements from
+// an Arena.  swap() exchanges two arrays without copying, as do the move
+// constructor and assignment in C++11.
+//
 
 
 namespace Util
 {
 
+  //
+  // bump allocator for arrays that live and die together, e.g. one per
+  // thread: allocate() carves aligned pieces out of large blocks, which are
+  // freed only by clear() or with the arena.  Arrays in an arena never
+  // destroy their elements, so it is meant for plain data.
+  //
+  class Arena
+  {
+      public:
+        Arena (size_t blockSize = 1<<20)
+        {
+          _blockSize = blockSize;
+          _next = NULL;
+          _left = 0;
+        }
+
+        ~Arena ()
+        {
+          clear ();
+        }
+
+        void* allocate (size_t bytes, size_t align = 16)
+        {
+          size_t pad = (align - (size_t)_next % align) % align;
+          if (pad + bytes > _left)
+          {
+            _left = (bytes + align > _blockSize) ? bytes + align : _blockSize;
+            _next = new char[_left];
+            _blocks.push_back(_next);
+            pad = (align - (size_t)_next % align) % align;
+          }
+          void* p = _next + pad;
+          _next += pad + bytes;
+          _left -= pad + bytes;
+          return p;
+        }
+
+        void clear ()
+        {
+          for (size_t i = 0; i < _blocks.size(); i++)
+          {
+            delete[] _blocks[i];
+          }
+          _blocks.clear();
+          _next = NULL;
+          _left = 0;
+        }
+
+      private:
+        Arena (const Arena&);
+        Arena& operator= (const Arena&);
+
+        size_t _blockSize;
+        std::vector<char*> _blocks;
+        char* _next;
+        size_t _left;
+  };
+
   template < class Elem > class Array1D;
   template < class Elem > class Array2D;
   template < class Elem > class Array3D;
@@ -72,6 +139,38 @@ namespace Util
           _alloc (n);
         }
 
+        // n elements from arena
+        Array1D (unsigned int n, Arena& arena)
+        {
+          _alloc (n, arena);
+        }
+
+        // a view of the n elements at data, which must outlive it
+        Array1D (const Elem* data, unsigned int n)
+        {
+          _n = n;
+          _array = const_cast<Elem*>(data);
+          _owned = false;
+        }
+
+#if __cplusplus >= 201103L
+        Array1D (Array1D<Elem>&& a)
+        {
+          _n = a._n;
+          _array = a._array;
+          _owned = a._owned;
+          a._n = 0;
+          a._array = NULL;
+          a._owned = true;
+        }
+
+        Array1D<Elem>& operator= (Array1D<Elem>&& rhs)
+        {
+          swap (rhs);
+          return *this;
+        }
+#endif
+
         ~Array1D ()
         {
           _delete ();
@@ -87,6 +186,22 @@ namespace Util
           }
         }
 
+        void resize (unsigned int n, Arena& arena)
+        {
+          if (!issize (n))
+          {
+            _delete ();
+            _alloc (n, arena);
+          }
+        }
+
+        void swap (Array1D<Elem>& a)
+        {
+          std::swap (_n, a._n);
+          std::swap (_array, a._array);
+          std::swap (_owned, a._owned);
+        }
+
         void init (const Elem & elem)
         {
           for (unsigned int i = 0; i < _n; i++)
@@ -116,6 +231,11 @@ namespace Util
           return _array;
         }
 
+        const Elem *data () const
+        {
+          return _array;
+        }
+
         Elem & operator()(unsigned int i)
         {
           assert (i < _n);
@@ -194,27 +314,37 @@ DEFOP(/=)
         friend class Array2D<Elem>;
         friend class Array3D<Elem>;
         friend class Array4D<Elem>;
-        Array1D (const Elem* data, unsigned int size)
+
+        void _alloc (unsigned int n)
         {
-          _n = size;
-          _array = const_cast<Elem*>(data);
+          _n = n;
+          _array = (n > 0) ? new Elem[_n] : NULL;
+          _owned = true;
         }
 
-        void _alloc (unsigned int n)
+        void _alloc (unsigned int n, Arena& arena)
         {
           _n = n;
-          _array = new Elem[_n];
+          _array = static_cast<Elem*>(arena.allocate(n*sizeof(Elem)));
+          for (unsigned int i = 0; i < n; i++)
+          {
+            new (_array + i) Elem();
+          }
+          _owned = false;
         }
 
         void _delete ()
         {
-          assert (_array != NULL);
-          delete[] _array;
+          if (_owned)
+          {
+            delete[] _array;
+          }
           _array = NULL;
         }
 
         unsigned int _n;
         Elem *_array;
+        bool _owned;
   };                            // class Array1D
 
   ///////////////////////////////////////////////////////////////////////////////
@@ -242,6 +372,42 @@ DEFOP(/=)
           _alloc (d0, d1);
         }
 
+        // d0 x d1 elements from arena
+        Array2D (unsigned int d0, unsigned int d1, Arena& arena)
+        {
+          _alloc (d0, d1, arena);
+        }
+
+        // a view of the d0 x d1 elements at data, which must outlive it
+        Array2D (const Elem* data, unsigned int d0, unsigned int d1) 
+        {
+          _array = const_cast<Elem*>(data);
+          _dim[0] = d0;
+          _dim[1] = d1;
+          _n = _dim[0]*_dim[1];
+          _owned = false;
+        }
+
+#if __cplusplus >= 201103L
+        Array2D (Array2D<Elem>&& a)
+        {
+          _n = a._n;
+          _dim[0] = a._dim[0];
+          _dim[1] = a._dim[1];
+          _array = a._array;
+          _owned = a._owned;
+          a._n = a._dim[0] = a._dim[1] = 0;
+          a._array = NULL;
+          a._owned = true;
+        }
+
+        Array2D<Elem>& operator= (Array2D<Elem>&& rhs)
+        {
+          swap (rhs);
+          return *this;
+        }
+#endif
+
         ~Array2D ()
         {
           _delete ();
@@ -257,6 +423,24 @@ DEFOP(/=)
           }
         }
 
+        void resize (unsigned int d0, unsigned int d1, Arena& arena)
+        {
+          if (!issize (d0, d1))
+          {
+            _delete ();
+            _alloc (d0, d1, arena);
+          }
+        }
+
+        void swap (Array2D<Elem>& a)
+        {
+          std::swap (_n, a._n);
+          std::swap (_dim[0], a._dim[0]);
+          std::swap (_dim[1], a._dim[1]);
+          std::swap (_array, a._array);
+          std::swap (_owned, a._owned);
+        }
+
         void init (const Elem & elem)
         {
           for (unsigned int i = 0; i < _n; i++)
@@ -374,32 +558,42 @@ DEFOP(/=)
 
         friend class Array3D<Elem>;
         friend class Array4D<Elem>;
-        Array2D (const Elem* data, unsigned int d0, unsigned int d1) 
+
+        void _alloc (unsigned int d0, unsigned int d1)
         {
-          _array = const_cast<Elem*>(data);
+          _n = d0 * d1;
           _dim[0] = d0;
           _dim[1] = d1;
-          _n = _dim[0]*_dim[1];
+          _array = (_n > 0) ? new Elem[_n] : NULL;
+          _owned = true;
         }
 
-        void _alloc (unsigned int d0, unsigned int d1)
+        void _alloc (unsigned int d0, unsigned int d1, Arena& arena)
         {
           _n = d0 * d1;
           _dim[0] = d0;
           _dim[1] = d1;
-          _array = new Elem[_n];
+          _array = static_cast<Elem*>(arena.allocate(_n*sizeof(Elem)));
+          for (unsigned int i = 0; i < _n; i++)
+          {
+            new (_array + i) Elem();
+          }
+          _owned = false;
         }
 
         void _delete ()
         {
-          assert (_array != NULL);
-          delete[]_array;
+          if (_owned)
+          {
+            delete[]_array;
+          }
           _array = NULL;
         }
 
         unsigned int _dim[2];
         unsigned int _n;
         Elem *_array;
+        bool _owned;
 
   }; // class Array2D
 
@@ -579,6 +773,7 @@ DEFOP(/=)
           _dim[1] = d1;
           _dim[2] = d2;
           _n = _dim[0]*_dim[1]*_dim[2];
+          _owned = false;
         }
 
 
@@ -586,6 +781,7 @@ DEFOP(/=)
         {
           _n = d0 * d1 * d2;
           _array = new Elem[_n];
+          _owned = true;
           _dim[0] = d0;
           _dim[1] = d1;
           _dim[2] = d2;
@@ -594,13 +790,17 @@ DEFOP(/=)
         void _delete ()
         {
           assert (_array != NULL);
-          delete[]_array;
+          if (_owned)
+          {
+            delete[]_array;
+          }
           _array = NULL;
         }
 
         unsigned int _n;
         Elem *_array;
         unsigned int _dim[3];
+        bool _owned;
   };                            // class Array3D
 
 
@@ -795,12 +995,14 @@ DEFOP(/=)
           _dim[2] = d2;
           _dim[3] = d3;
           _n = _dim[0]*_dim[1]*_dim[2]*_dim[3];
+          _owned = false;
         }
 
         void _alloc (unsigned int d0, unsigned int d1, unsigned int d2, unsigned int d3)
         {
           _n = d0 * d1 * d2 * d3;
           _array = new Elem[_n];
+          _owned = true;
           _dim[0] = d0;
           _dim[1] = d1;
           _dim[2] = d2;
@@ -810,13 +1012,17 @@ DEFOP(/=)
         void _delete ()
         {
           assert(_array != NULL);
-          delete[]_array;
+          if (_owned)
+          {
+            delete[]_array;
+          }
           _array = NULL;
         }
 
         unsigned int _n;
         Elem *_array;
         unsigned int _dim[4];
+        bool _owned;
 
   }; // class Array4D
 
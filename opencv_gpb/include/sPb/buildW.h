@@ -6,6 +6,8 @@
 #include <string.h>
 #include <fstream>
 #include <iostream>
+#include <vector>
+#include <algorithm>
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
 #include <opencv2/core/core.hpp>
@@ -15,7 +17,45 @@
 #include "ic.h"
 
 
+// layouts buildW can store the affinity in
+#define W_STORAGE_CSR     0   // full CSR SMatrix
+#define W_STORAGE_STENCIL 1   // matrix-free StencilMatrix
+#define W_STORAGE_UPPER   2   // CSR SMatrix, upper triangle and diagonal
+
 namespace cv
 {
-  void buildW(const cv::Mat & input, double** &T, int & wz, double* &D);
+  // sparsification of the CSR affinity (the stencil keeps the full disc
+  // and ignores all of these)
+  struct AffinityOptions
+  {
+    float epsilon;	// drop off-diagonal affinities below this
+    float ic_thresh;	// stop an intervening contour once its max pb reaches this
+    int long_range;	// random links per pixel beyond the disc, 0 for none
+    int long_radius;	// ... up to this many pixels away
+
+    AffinityOptions() : epsilon(0.0f), ic_thresh(1.0f),
+			long_range(0), long_radius(15) {}
+  };
+
+  void buildW(const cv::Mat & input, LinearOperator* &W, double* &D,
+	      int storage = W_STORAGE_CSR,
+	      const AffinityOptions & options = AffinityOptions());
+
+  // superpixels of buildSuperpixelW: centroids, and for superpixel i its
+  // neighbours adj[start[i]..start[i+1]) with their affinity to i
+  struct SuperpixelGraph
+  {
+    std::vector<double> cx, cy;
+    std::vector<int> start;
+    std::vector<int> adj;
+    std::vector<float> affinity;
+  };
+
+  // W between the superpixels labels (1..nlabels, CV_32S) of input: the
+  // intervening contour along the line joining the centroids of adjacent
+  // superpixels, weighted so that W approximates the pixel affinity of
+  // buildW summed over pairs of superpixels
+  void buildSuperpixelW(const cv::Mat & input, const cv::Mat & labels,
+			int nlabels, SMatrix* &W, double* &D,
+			SuperpixelGraph & graph);
 }
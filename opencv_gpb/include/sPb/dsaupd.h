@@ -9,34 +9,36 @@
   
   The remaining parameters to the function calls are as follows:
   
-    dsaupd(int n, int nev, double *Evals)
-    dsaupd(int n, int nev, doubel *Evals, double **Evecs)
+    int dsaupd(const LinearOperator & A, int nev, double *Evals, Real **Evecs,
+               int *products = NULL, const char *which = "SM",
+               double tol = 1e-3, const double *resid0 = NULL,
+               int ncv = 0)
 
-    n: the order of the square matrix A
+    A: the square sparse matrix; its order n is A.n
     nev: the number of eigenvalues to be found, starting at the
          bottom.  Note that the highest eigenvalues, or some
-	 other choices, can be found.  For now, the choice of
-	 the lowest nev eigenvalues is hard-coded.
+	 other choices, can be found.
     Evals: a one-dimensional array of length nev to hold the
            eigenvalues.
     Evecs: a two-dimensional array of size nev by n to hold the
-           eigenvectors.  If this argument is not provided, the
-	   eigenvectors are not calculated.  Note that the
-	   vectors are stored as columns of Evecs, so that the
-	   elements of vector i are the values Evecs[j][i].
-
-  The function is overdefined, so that you can call it in either
-  fashion and the appropriate version will be run.
-
-  To use these function calls, there must be a function
-  defined in the calling program of the form
-
-    av(int n, double *in, double *out)
-
-  where the function av finds out = A.in, and n is the order of
-  the matrix A.  This function must be defined before the
-  statement that includes this header file, as it needs to know
-  about this function.  It is used in the looping procedure.
+           eigenvectors, so that the elements of vector i are
+	   the values Evecs[i][j].  Real is double or float.
+    products: if given, receives the number of products with A.
+    which: the ARPACK selection, "SM" (smallest magnitude, the
+           default) or e.g. "LA" (largest algebraic).
+    tol: ARPACK's relative tolerance on the Ritz estimates.
+    resid0: if given, the n-vector ARPACK starts from (info = 1)
+            instead of a random one.
+    ncv: the number of Lanczos basis vectors, 4*nev if 0.  The
+         basis takes n*ncv doubles; ARPACK needs ncv > nev and
+	 converges more slowly as ncv approaches nev.
+
+  It returns the number of Arnoldi update iterations taken.
+  dsaupdMemory(n, ncv) gives the bytes it allocates.
+
+  The matrix A is passed in as a LinearOperator (a CSR SMatrix or
+  a matrix-free StencilMatrix) and the product out = A.in needed by
+  the looping procedure is computed by av().
 
   Scot Shaw
   30 August 1999
@@ -45,11 +47,13 @@
 
   Di Yang
   29 August 2013
+
+  A is now a LinearOperator rather than a triplet array.
 */
 
 using namespace std;
 
-void av(double **T, int tlen, int n, double *in, double* out);
+void av(const LinearOperator & A, double *in, double* out);
 
 extern "C" void dsaupd_(int *ido, char *bmat, int *n, char *which,
 			int *nev, double *tol, double *resid, int *ncv,
@@ -65,25 +69,30 @@ extern "C" void dseupd_(int *rvec, char *All, int *select, double *d,
 			double *workl, int *lworkl, int *ierr);
 
 
-void av(double** T, int tlen, int n, double *in, double *out)
+void av(const LinearOperator & A, double *in, double *out)
 {
-  for(size_t i=0; i<n; i++) 
-    out[i] = 0;
-  for(size_t i=0; i<tlen; i++)
-    out[(int)T[i][0]] += in[(int)T[i][1]] * T[i][2];
+  A.mult(in, out);
 }
 
-void dsaupd(double** T, int tlen, int n, int nev, double *Evals, double **Evecs)
+size_t dsaupdMemory(int n, int ncv)
 {
+  return ((size_t)n*(ncv+4) + (size_t)ncv*(ncv+8) + 3*(size_t)ncv)*sizeof(double);
+}
+
+template <typename Real>
+int dsaupd(const LinearOperator & A, int nev, double *Evals, Real **Evecs,
+	   int *products = NULL, const char *which_ = "SM", double tol = 1e-3,
+	   const double *resid0 = NULL, int ncv_ = 0)
+{
+  int n = A.n;
   int ido = 0;
   char bmat[2] = "I";
-  char which[3] = "SM";
-  double tol = 1e-3;
+  char which[3] = {which_[0], which_[1], 0};
   double *resid = new double[n];
-  int ncv = 4*nev;
+  int ncv = ncv_ > 0 ? ncv_ : 4*nev;
   if (ncv>n) ncv = n;
   int ldv = n;
-  double *v = new double[ldv*ncv];
+  double *v = new double[(size_t)ldv*ncv];
   int *iparam = new int[11];
   iparam[0] = 1;
   iparam[2] = 3*n;
@@ -93,19 +102,27 @@ void dsaupd(double** T, int tlen, int n, int nev, double *Evals, double **Evecs)
   double *workl = new double[ncv*(ncv+8)];
   int lworkl = ncv*(ncv+8);
   int info = 0;
+  if (resid0) {
+    for (int j=0; j<n; j++)
+      resid[j] = resid0[j];
+    info = 1;
+  }
   int rvec = 1;  // Changed from above
   int *select = new int[ncv];
   double *d = new double[2*ncv];
   double sigma;
   int ierr;
   char howmny[2] = "A";
+  int nprod = 0;
 
   do {
     dsaupd_(&ido, bmat, &n, which, &nev, &tol, resid, 
 	    &ncv, v, &ldv, iparam, ipntr, workd, workl,
 	    &lworkl, &info);    
-    if ((ido==1)||(ido==-1))
-      av(T, tlen, n, workd+ipntr[0]-1, workd+ipntr[1]-1);
+    if ((ido==1)||(ido==-1)) {
+      av(A, workd+ipntr[0]-1, workd+ipntr[1]-1);
+      nprod++;
+    }
   } while ((ido==1)||(ido==-1));
 
   if (info<0) {
@@ -129,16 +146,18 @@ void dsaupd(double** T, int tlen, int n, int nev, double *Evals, double **Evecs)
     for (size_t i=0; i<nev; i++) 
       Evals[i] = d[i];
     for (size_t i=0; i<nev; i++) 
-      for (size_t j=0; j<n; j++) 
-	Evecs[i][j] = v[i*n+j];
-
-    delete resid;
-    delete v;
-    delete iparam;
-    delete ipntr;
-    delete workd;
-    delete workl;
-    delete select;
-    delete d;
+      std::copy(v+i*n, v+(i+1)*n, Evecs[i]);
+
   }
+  int iterations = iparam[2];
+  delete[] resid;
+  delete[] v;
+  delete[] iparam;
+  delete[] ipntr;
+  delete[] workd;
+  delete[] workl;
+  delete[] select;
+  delete[] d;
+  if (products) *products = nprod;
+  return iterations;
 }
@@ -19,6 +19,8 @@
 
 #ifndef IC_HH
 #define IC_HH
+#include <assert.h>
+#include <vector>
 #include <opencv2/core/core.hpp>
 #include "array.h"
 
@@ -27,14 +29,41 @@
 //
 namespace Group
 {
-  // data types for storing sparse ic info
+  //
+  // pb on the lattice edges between the pixels of a width x height image:
+  // H edge (x,y) lies above pixel (x,y), V edge (x,y) left of it, for x up
+  // to width and y up to height (0 past the image).  the two are
+  // interleaved, H then V, in rows of stride = height+1 pairs per x: the
+  // H and V of one (x,y) are adjacent and a step in y reads the next pair,
+  // while a step in x jumps a row.
+  //
   struct DualLattice
   {
-    cv::Mat H;
-    cv::Mat V;
+    cv::Mat HV;       // CV_32FC2, width+1 rows of stride pairs
     int width;
     int height;
+    int stride;
+
+    // edge (x,y) of H (lat 0) or V (lat 1), bounds checked only in
+    // debug builds
+    float edge(const int lat, const int x, const int y) const
+    {
+      assert (x >= 0 && x <= width && y >= 0 && y <= height);
+      return ((const float*)HV.data)[((size_t)x*stride + y)*2 + lat];
+    }
+
+    // the H and V pair of (x,y), for offsets in floats from it
+    const float* edges(const int x, const int y) const
+    {
+      return (const float*)HV.data + ((size_t)x*stride + y)*2;
+    }
   };
+
+  //
+  // the lattice of a pb image (CV_32FC1): H edge (x,y) takes the pb of
+  // pixel (x,y-1), V edge (x,y) that of (x-1,y)
+  //
+  void buildDualLattice(const cv::Mat& pb, DualLattice& boundaries);
  
 
 
@@ -48,9 +77,14 @@ namespace Group
   };
 
   //
-  // (1-ic) from each pixel to some set of neighbors
+  // (1-ic) from each pixel to some set of neighbors; the per-pixel arrays
+  // live in the map's arena, so filling it costs a few large allocations
+  // instead of one per pixel
   //
-  typedef Util::Array2D< Util::Array1D<PointIC> > SupportMap;
+  struct SupportMap : public Util::Array2D< Util::Array1D<PointIC> >
+  {
+    Util::Arena arena;
+  };
 
   //
   // given a pb image and window radius, computes a support map (1-ic) for each
@@ -68,6 +102,46 @@ namespace Group
                           const int x0, const int y0, const int wr,
                           Util::Array1D<PointIC> &adj, int &count);
 
+  //
+  // the same with caller-owned scratch space (resized as needed), for loops
+  // that should not allocate per pixel.
+  //
+  void interveningContour(const DualLattice& boundaries, const float thresh,
+                          const int x0, const int y0, const int wr,
+                          Util::Array1D<PointIC> &adj, int &count,
+                          Util::Array2D<PointIC> &scanLines,
+                          Util::Array1D<int> &scanCount,
+                          Util::Array1D<PointIC> &scratch);
+
+  //
+  // the rays interveningContour walks from a pixel whose box of radius wr
+  // lies inside the image.  relative to the pixel they are the same for
+  // every such pixel, so they are laid out once: each step of a ray has 4
+  // lattice edges (a single crossed edge is repeated) as float offsets
+  // from the pixel's edges() in the interleaved lattice, and the slot of
+  // the point it records, if any.  slots are in scanline order.
+  //
+  struct RayTemplate
+  {
+    int wr;
+    int stride;                 // lattice stride the offsets are for
+    std::vector<int> ray;       // first step of each ray, then the end
+    std::vector<int> offset;    // 4 per step
+    std::vector<int> slot;      // per step, -1 when nothing is recorded
+    std::vector<int> dx, dy;    // per slot
+  };
+
+  void buildRayTemplate(const DualLattice& boundaries, const int wr, RayTemplate& rays);
+
+  //
+  // interveningContour from the template, a max-scan along each ray over
+  // the lattice values.  returns false, leaving adj alone, when the box
+  // of (x0,y0) is clipped by the image.
+  //
+  bool interveningContour(const DualLattice& boundaries, const RayTemplate& rays,
+                          const float thresh, const int x0, const int y0,
+                          Util::Array1D<PointIC> &adj, int &count);
+
   //
   // compute (1 - max over lattice energies on a straightline path connecting p1 and p2)
   //
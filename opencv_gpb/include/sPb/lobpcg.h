@@ -0,0 +1,123 @@
+//
+//    Block eigensolver (LOBPCG) for the smallest eigenpairs of a
+//    symmetric LinearOperator, and the preconditioners it can use.
+//    An in-tree alternative to the ARPACK dsaupd loop.
+//
+
+#ifndef __lobpcg_h__
+#define __lobpcg_h__
+
+#include "smatrix.h"
+
+//
+// approximates (A + shift I)^-1
+//
+class Preconditioner
+{
+  public:
+    virtual ~Preconditioner() {}
+
+    // out = T * in
+    virtual void apply(const double* in, double* out) const = 0;
+};
+
+//
+// inverse of the (shifted) diagonal of A
+//
+class JacobiPreconditioner : public Preconditioner
+{
+  public:
+    JacobiPreconditioner(const LinearOperator& A, double shift);
+    ~JacobiPreconditioner();
+
+    void apply(const double* in, double* out) const;
+
+  private:
+    int n;
+    double* invdiag;
+};
+
+//
+// one V-cycle of aggregation multigrid on a width x height pixel grid (A in
+// scanline order).  each level merges 2x2 blocks of the level below with a
+// piecewise constant prolongation; the coarse operators P^T A P are kept
+// as StencilMatrix.  damped Jacobi smoothing on every level.
+//
+class MultigridPreconditioner : public Preconditioner
+{
+  public:
+    MultigridPreconditioner(const LinearOperator& A, int width, int height,
+                            double shift);
+    ~MultigridPreconditioner();
+
+    void apply(const double* in, double* out) const;
+
+    int levels() const { return nlevels; }
+
+  private:
+    struct Level
+    {
+      const LinearOperator* A;
+      double shift;          // only the finest level is shifted explicitly
+      double* invdiag;
+      int width;
+      int height;
+      double* b;             // right hand side, coarse levels only
+      double* x;             // solution, coarse levels only
+      double* r;             // residual
+    };
+
+    void vcycle(int l, const double* b, double* x) const;
+    void smooth(const Level& L, const double* b, double* x, int sweeps) const;
+
+    int nlevels;
+    Level* level;
+};
+
+//
+// lets the caller end lobpcg early: stop() is asked after every iteration
+// with the number of leading pairs converged so far and the current Ritz
+// values (nev of them, increasing), and ends the iteration with true
+//
+class LobpcgMonitor
+{
+  public:
+    virtual ~LobpcgMonitor() {}
+
+    virtual bool stop(int converged, const double* lambda, int nev) const = 0;
+};
+
+//
+// finds the nev smallest eigenpairs of A.  Evals has nev entries, Evecs
+// nev vectors of A.n entries.  a pair is converged once its residual
+// norm is below tol times the largest wanted eigenvalue.  T may be NULL.
+// returns the number of iterations, and the number of products with A in
+// *products if given.  the initial block is taken from the nstart
+// vectors at start (vector i at start + i*A.n), padded with random ones.
+// nev may not exceed A.n (all outputs are zero then).
+// monitor may stop it early; *converged, if given, receives the number of
+// leading pairs that had converged (fewer than nev if stopped or out of
+// iterations), the rest of Evals and Evecs holding the current Ritz pairs.
+//
+int lobpcg(const LinearOperator& A, int nev, double* Evals, double** Evecs,
+           const Preconditioner* T, double tol, int maxit,
+           int* products = NULL, const double* start = NULL, int nstart = 0,
+           const LobpcgMonitor* monitor = NULL, int* converged = NULL);
+
+//
+// the same in float: eigenvectors, start vectors and the search space,
+// which halves the memory.  products with A and T and all inner products
+// are still formed in double.
+//
+int lobpcg(const LinearOperator& A, int nev, double* Evals, float** Evecs,
+           const Preconditioner* T, double tol, int maxit,
+           int* products = NULL, const float* start = NULL, int nstart = 0,
+           const LobpcgMonitor* monitor = NULL, int* converged = NULL);
+
+//
+// bytes lobpcg allocates for nev eigenpairs of an order n operator, with
+// a search space of elem byte entries (preconditioner and outputs aside)
+//
+size_t lobpcgMemory(int n, int nev, size_t elem);
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef __normCut_h__
+#define __normCut_h__
+
 #include <iostream>
 #include <fstream>
 #include <math.h>
@@ -5,13 +8,79 @@
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
 #include <opencv2/core/core.hpp>
+#include "smatrix.h"
+#include "stripMatrix.h"
+
+// eigensolvers normalise_cut can use
+#define NCUT_ARPACK 0
+#define NCUT_LOBPCG 1
+
+// what ARPACK is run on
+#define NCUT_MODE_LAPLACIAN 0   // "SM" on L = I - D^-1/2 W D^-1/2
+#define NCUT_MODE_AFFINITY  1   // "LA" on D^-1/2 W D^-1/2 + shift I
+
+// preconditioners for NCUT_LOBPCG
+#define NCUT_PRECOND_NONE      0
+#define NCUT_PRECOND_JACOBI    1
+#define NCUT_PRECOND_MULTIGRID 2   // needs W on the rows x cols pixel grid
 
 namespace cv{
-void normalise_cut(double **T, 
-		   int tlen, 
+struct NCutOptions
+{
+  int solver;
+  int mode;              // ARPACK only, LOBPCG always works on L
+  double shift;          // NCUT_MODE_AFFINITY spectral shift
+  double affinity_tol;   // ARPACK tolerance in NCUT_MODE_AFFINITY
+  int precond;
+  double precond_shift;  // the preconditioner approximates (L + shift I)^-1
+  double tol;            // LOBPCG residual tolerance, relative to the top eigenvalue
+  int maxit;
+  bool lean;             // float eigenvectors written straight into sPb_raw, a
+                         // float LOBPCG search space, an ARPACK basis of 2*nev+1
+  double max_memory_mb;  // cap on the eigensolver allocations (0: none); the
+                         // settings turn lean, then the ARPACK basis shrinks,
+                         // then fewer eigenvectors are sought, and if even
+                         // two do not fit sPb_raw is left empty
+  double time_budget;    // anytime mode, LOBPCG only: stop after this many
+                         // seconds of eigensolve (0: none) ...
+  double min_contribution; // ... or once the next eigenvector's sPb weight
+                         // 1/sqrt(lambda) is below this part of the converged
+                         // ones' (0: never); sPb_raw gets the converged planes
+
+  NCutOptions()
+    : solver(NCUT_ARPACK), mode(NCUT_MODE_LAPLACIAN), shift(0.0),
+      affinity_tol(1e-6), precond(NCUT_PRECOND_MULTIGRID),
+      precond_shift(1e-2), tol(1e-3), maxit(500), lean(false),
+      max_memory_mb(0.0), time_budget(0.0), min_contribution(0.0) {}
+};
+
+// start: optional rows x cols CV_32FC1 planes (e.g. the upsampled sPb_raw
+// of a coarser solve) whose span, together with the constant vector, is
+// used as the solver's starting subspace.  sPb_raw comes back empty, with
+// an error on cerr, when options.max_memory_mb cannot be met
+void normalise_cut(LinearOperator & W, 
 		   int rows,
 		   int cols,
 		   double *D, 
 		   int nev,
-		   std::vector<cv::Mat> & sPb_raw);
+		   std::vector<cv::Mat> & sPb_raw,
+		   const NCutOptions & options = NCutOptions(),
+		   const std::vector<cv::Mat> * start = NULL);
+
+#ifdef GPB_MPI
+// the same with PARPACK on a W split in row strips: every rank of W.comm
+// passes its strip (rows x cols pixels) and the D of its rows, and rank 0
+// receives the sPb_raw planes of the whole image.  the solver is always
+// ARPACK, options.mode picks SM or LA; lean, memory caps and start
+// vectors do not apply.
+void normalise_cut(StripMatrix & W,
+		   int rows,
+		   int cols,
+		   double *D,
+		   int nev,
+		   std::vector<cv::Mat> & sPb_raw,
+		   const NCutOptions & options = NCutOptions());
+#endif
 }
+
+#endif
@@ -0,0 +1,133 @@
+/*
+  The distributed counterpart of dsaupd.h: the same simplified call,
+  to PARPACK's pdsaupd/pdseupd, for an operator whose rows are split
+  across the ranks of an MPI communicator.
+
+    int pdsaupd(MPI_Comm comm, const LinearOperator & A, int nev,
+                double *Evals, Real **Evecs, int *products = NULL,
+                const char *which = "SM", double tol = 1e-3,
+                int ncv = 0)
+
+    comm: the ranks sharing the problem, all of which must call
+          pdsaupd together.
+    A: the rows of the operator held by this rank; A.n is the local
+       row count and A.mult() does whatever communication the
+       product needs (a StripMatrix exchanges its halo rows).
+    Evals: the nev eigenvalues, the same on every rank.
+    Evecs: the local rows of the eigenvectors, nev arrays of A.n.
+    products, which, tol, ncv: as for dsaupd.  ncv is capped by the
+       global order.
+
+  It returns the number of Arnoldi update iterations taken.
+  pdsaupdMemory(n, ncv) gives the bytes one rank allocates for n local
+  rows.
+*/
+
+#include <mpi.h>
+
+using namespace std;
+
+extern "C" void pdsaupd_(MPI_Fint *comm, int *ido, char *bmat, int *n,
+			 char *which, int *nev, double *tol, double *resid,
+			 int *ncv, double *v, int *ldv, int *iparam,
+			 int *ipntr, double *workd, double *workl,
+			 int *lworkl, int *info);
+
+extern "C" void pdseupd_(MPI_Fint *comm, int *rvec, char *All, int *select,
+			 double *d, double *v, int *ldv, double *sigma,
+			 char *bmat, int *n, char *which, int *nev,
+			 double *tol, double *resid, int *ncv, double *vv,
+			 int *ldvv, int *iparam, int *ipntr, double *workd,
+			 double *workl, int *lworkl, int *ierr);
+
+size_t pdsaupdMemory(int n, int ncv)
+{
+  return ((size_t)n*(ncv+4) + (size_t)ncv*(ncv+8) + 3*(size_t)ncv)*sizeof(double);
+}
+
+template <typename Real>
+int pdsaupd(MPI_Comm comm, const LinearOperator & A, int nev, double *Evals,
+	    Real **Evecs, int *products = NULL, const char *which_ = "SM",
+	    double tol = 1e-3, int ncv_ = 0)
+{
+  MPI_Fint fcomm = MPI_Comm_c2f(comm);
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  int n = A.n;
+  int N = 0;
+  MPI_Allreduce(&n, &N, 1, MPI_INT, MPI_SUM, comm);
+  int ido = 0;
+  char bmat[2] = "I";
+  char which[3] = {which_[0], which_[1], 0};
+  double *resid = new double[n];
+  int ncv = ncv_ > 0 ? ncv_ : 4*nev;
+  if (ncv>N) ncv = N;
+  int ldv = n;
+  double *v = new double[(size_t)ldv*ncv];
+  int *iparam = new int[11];
+  iparam[0] = 1;
+  iparam[2] = 3*N;
+  iparam[6] = 1;
+  int *ipntr = new int[11];
+  double *workd = new double[3*n];
+  double *workl = new double[ncv*(ncv+8)];
+  int lworkl = ncv*(ncv+8);
+  int info = 0;
+  int rvec = 1;
+  int *select = new int[ncv];
+  double *d = new double[2*ncv];
+  double sigma;
+  int ierr;
+  char howmny[2] = "A";
+  int nprod = 0;
+
+  do {
+    pdsaupd_(&fcomm, &ido, bmat, &n, which, &nev, &tol, resid,
+	     &ncv, v, &ldv, iparam, ipntr, workd, workl,
+	     &lworkl, &info);
+    if ((ido==1)||(ido==-1)) {
+      A.mult(workd+ipntr[0]-1, workd+ipntr[1]-1);
+      nprod++;
+    }
+  } while ((ido==1)||(ido==-1));
+
+  if (info<0) {
+    if (rank==0) {
+      cout << "Error with pdsaupd, info = " << info << "\n";
+      cout << "Check documentation in pdsaupd\n\n";
+    }
+  } else {
+    pdseupd_(&fcomm, &rvec, howmny, select, d, v, &ldv, &sigma, bmat,
+	     &n, which, &nev, &tol, resid, &ncv, v, &ldv,
+	     iparam, ipntr, workd, workl, &lworkl, &ierr);
+
+    // every rank has the same info, rank 0 reports it
+    if (rank==0) {
+      if (ierr!=0) {
+	cout << "Error with pdseupd, info = " << ierr << "\n";
+	cout << "Check the documentation of pdseupd.\n\n";
+      } else if (info==1) {
+	cout << "Maximum number of iterations reached.\n\n";
+      } else if (info==3) {
+	cout << "No shifts could be applied during implicit\n";
+	cout << "Arnoldi update, try increasing NCV.\n\n";
+      }
+    }
+
+    for (size_t i=0; i<nev; i++)
+      Evals[i] = d[i];
+    for (size_t i=0; i<nev; i++)
+      std::copy(v+i*n, v+(i+1)*n, Evecs[i]);
+  }
+  int iterations = iparam[2];
+  delete[] resid;
+  delete[] v;
+  delete[] iparam;
+  delete[] ipntr;
+  delete[] workd;
+  delete[] workl;
+  delete[] select;
+  delete[] d;
+  if (products) *products = nprod;
+  return iterations;
+}
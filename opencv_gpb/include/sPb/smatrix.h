@@ -23,18 +23,119 @@
 #include <stdio.h>
 #include "array.h"
 
-class SMatrix
+//
+// square operator the eigensolver works with: anything that can apply
+// itself to a vector and be turned into a normalized Laplacian in place
+//
+class LinearOperator
+{
+  public:
+    virtual ~LinearOperator() {}
+
+    // out = this * in
+    virtual void mult(const double* in, double* out) const = 0;
+
+    // D[i] = sum of row i
+    virtual void rowSums(double* D) const = 0;
+
+    // this -> I - D^-1 this D^-1, where D holds the square roots of the
+    // row sums
+    virtual void normalize(const double* D) = 0;
+
+    // this -> D^-1 this D^-1 + shift I, the normalized affinity whose
+    // largest eigenvalues are 1 + shift minus the smallest of the Laplacian
+    virtual void normalizeAffinity(const double* D, double shift) = 0;
+
+    // the entries of row r that are actually stored, at most
+    // maxRowEntries() of them; returns their count.  when halfStored()
+    // each off-diagonal entry also stands for its transpose.
+    virtual int storedRow(int r, int* cols, float* vals) const = 0;
+    virtual int maxRowEntries() const = 0;
+    virtual bool halfStored() const { return false; }
+
+    int n;
+};
+
+//
+// sparse matrix in compressed sparse row form: the entries of row r are
+// col[row[r] .. row[r+1]-1] and values[row[r] .. row[r+1]-1], with the
+// columns of each row in increasing order.  Once dropLower() has been
+// called only the upper triangle and diagonal are kept, and mult applies
+// every off-diagonal entry to both (r,c) and (c,r).
+//
+class SMatrix : public LinearOperator
 {
   public:
-    SMatrix(int n, int* nz, int** col, double** values);
+    // takes ownership of the arrays; row has n+1 entries
+    SMatrix(int n, int* row, int* col, float* values);
     ~SMatrix();
 
     void symmetrize();
 
-    int n;
-    int** col;
-    int* nz;
-    double** values;
+    // keep only entries with col >= row; the matrix must be symmetric
+    void dropLower();
+
+    // drop the off-diagonal entries below epsilon; the pattern stays
+    // symmetric if the values are
+    void sparsify(float epsilon);
+
+    // out = this * in, rows split across threads
+    void mult(const double* in, double* out) const;
+    void rowSums(double* D) const;
+    void normalize(const double* D);
+    void normalizeAffinity(const double* D, double shift);
+    int storedRow(int r, int* cols, float* vals) const;
+    int maxRowEntries() const;
+    bool halfStored() const { return upper; }
+
+    int nnz;
+    int* row;
+    int* col;
+    float* values;
+    bool upper;
+
+  private:
+    // row ranges holding roughly the same number of nonzeros each.  in
+    // upper form every block spans at least bandwidth rows,
+    // so blocks of the same parity never scatter into the same rows.
+    void partition();
+
+    int nblocks;
+    int* blocks;
+    int bandwidth;    // max col-row, only used in upper form
+};
+
+//
+// matrix-free form of an affinity that links every pixel of a width x
+// height grid (scanline order) to the same disc of offsets.  Only the
+// weights are stored, one plane of n floats per offset: entry (i, i+off(k))
+// is weights[k*n+i], and is zero where the offset leaves the image.
+// The disc is point symmetric, offset K-1-k is the negation of offset k.
+//
+class StencilMatrix : public LinearOperator
+{
+  public:
+    StencilMatrix(int width, int height, float dthresh);
+    ~StencilMatrix();
+
+    void symmetrize();
+
+    // out = this * in, image rows split across threads
+    void mult(const double* in, double* out) const;
+    void rowSums(double* D) const;
+    void normalize(const double* D);
+    void normalizeAffinity(const double* D, double shift);
+    int storedRow(int r, int* cols, float* vals) const;
+    int maxRowEntries() const { return K; }
+
+    float* plane(int k) { return weights + (size_t)k*n; }
+
+    int width;
+    int height;
+    int K;
+    int* du;          // row offset of each stencil entry
+    int* dv;          // column offset of each stencil entry
+    float* weights;
 };
 
 #endif
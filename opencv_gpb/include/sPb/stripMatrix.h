@@ -0,0 +1,53 @@
+#ifndef __stripMatrix_h__
+#define __stripMatrix_h__
+
+#ifdef GPB_MPI
+
+#include <mpi.h>
+#include <vector>
+#include "smatrix.h"
+
+//
+// one rank's share of a pixel affinity split in strips of image rows
+// across the ranks of comm, rank order top to bottom.  The rank holds the
+// n = rows*width rows of its strip in CSR form; their columns index the
+// strip extended by top halo rows above it and bottom below, whose values
+// mult() and normalize() fetch from the neighbouring ranks.  The halos
+// must not be taller than the neighbouring strips.
+//
+class StripMatrix : public LinearOperator
+{
+  public:
+    // takes ownership of the arrays; row has n+1 entries
+    StripMatrix(MPI_Comm comm, int width, int top, int bottom,
+                int n, int* row, int* col, float* values);
+    ~StripMatrix();
+
+    // ext = in with the halo rows of the neighbours around it
+    void exchange(const double* in, double* ext) const;
+
+    // collective: every rank of comm calls them together
+    void mult(const double* in, double* out) const;
+    void normalize(const double* D);
+    void normalizeAffinity(const double* D, double shift);
+
+    void rowSums(double* D) const;
+    // columns index the extended strip
+    int storedRow(int r, int* cols, float* vals) const;
+    int maxRowEntries() const;
+
+    MPI_Comm comm;
+    int width;
+    int top;          // halo rows above the strip, 0 on the first rank
+    int bottom;       // halo rows below the strip, 0 on the last rank
+    int up;           // the neighbouring ranks, or MPI_PROC_NULL
+    int down;
+
+  private:
+    SMatrix* local;   // n rows, columns into the extended strip
+    mutable std::vector<double> ext;
+};
+
+#endif
+
+#endif
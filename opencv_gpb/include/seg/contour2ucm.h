@@ -52,5 +52,6 @@ namespace cv
   void contour2ucm(const cv::Mat & gPb,
 		   const vector<cv::Mat> & gPb_ori,
 		   cv::Mat & ucm,
-		   bool label);
+		   bool label,
+		   MergeTree * tree = NULL);
 }
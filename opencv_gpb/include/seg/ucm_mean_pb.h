@@ -1,3 +1,6 @@
+#ifndef __ucm_mean_pb_h__
+#define __ucm_mean_pb_h__
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>                                       
@@ -8,6 +11,7 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <algorithm>
 
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
@@ -17,8 +21,33 @@
 #define SINGLE_SIZE 0
 
 namespace cv{
+  //
+  // the merges behind an ultrametric contour map.  Node i < leaves is
+  // region i of the initial partition and node leaves+k the k-th merge,
+  // which removes the boundary of ucm value saliency[leaves+k] between its
+  // two children; parents come after their children.
+  //
+  struct MergeTree
+  {
+    int leaves;
+    std::vector<int> parent;       // -1 at the roots
+    std::vector<double> saliency;  // 0 at the leaves
+    std::vector<int> size;         // pixels under the node
+    cv::Mat partition;             // leaf of every pixel, CV_32SC1
+
+    // the segments left once every merge of saliency below thres is made,
+    // as in a ucm thresholded at thres > 0: the segment (from 0) of every
+    // leaf, in O(nodes).  Returns the number of segments.
+    int cut(double thres, std::vector<int> & segment) const;
+    // the same for every pixel, in a CV_32SC1 image
+    int cut(double thres, cv::Mat & labels) const;
+  };
+
   void ucm_mean_pb(const cv::Mat & input1,
 		   const cv::Mat & input2,
 		   cv::Mat & output,
-		   bool label);
+		   bool label,
+		   MergeTree * tree = NULL);
 }
+
+#endif
@@ -19,6 +19,8 @@
 #define SINGLE_SIZE 0
 
 namespace cv{
+  struct MergeTree;
+
   void uvt(const cv::Mat & ucm_mtr,
 	   const cv::Mat & seeds,
 	   cv::Mat & boundary,
@@ -30,5 +32,12 @@ namespace cv{
 	       cv::Mat & labels,
 	       double thres,
 	       bool sz);
+
+  // the same at single size from the merge tree of the ucm: the segments
+  // come from a cut of the tree, and labels (CV_32SC1) numbers them
+  void ucm2seg(const MergeTree & tree,
+	       cv::Mat & boundary,
+	       cv::Mat & labels,
+	       double thres);
   
 }
@@ -41,4 +41,12 @@ namespace cv
   watershedFull(const cv::Mat & image, 
 		int window_size, 
 		cv::Mat & regions);
+
+  // watershed of image (0..255) flooded from one seed per step x step
+  // cell, each at the lowest pixel near the cell centre.  Matlab
+  // convention as watershedFull: 0 on the watershed lines, regions from 1
+  void
+  watershedGrid(const cv::Mat & image,
+		int step,
+		cv::Mat & regions);
 }
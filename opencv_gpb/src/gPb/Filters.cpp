@@ -644,6 +644,54 @@ num_bins_);
     }
     
     
+    /*
+     * Upsample a 2x decimated map (coarse pixel (y,x) sits on fine pixel
+     * (2y,2x)) to the size of guide. Each fine pixel blends its four coarse
+     * neighbours with bilinear weights times a range weight on the guide,
+     * so values do not bleed across edges of the guide image.
+     */
+    void
+    jointBilateralUpsample(const cv::Mat & coarse,
+                           const cv::Mat & guide,
+                           cv::Mat & output,
+                           double sigma_r)
+    {
+        cv::Mat_<float> coarse_f, guide_f;
+        coarse.convertTo(coarse_f, CV_32F);
+        guide.convertTo(guide_f, CV_32F);
+        output.create(guide.rows, guide.cols, CV_32FC1);
+
+        float range_tab[256];
+        for (int d = 0; d < 256; d++)
+            range_tab[d] = float(exp(-double(d*d)/(2.0*sigma_r*sigma_r)));
+
+        for (int i = 0; i < output.rows; i++) {
+            int y0 = std::min(i/2, coarse_f.rows-1), y1 = std::min(y0+1, coarse_f.rows-1);
+            float fy = 0.5f*float(i - 2*y0);
+            float *out_ptr = output.ptr<float>(i);
+            const float *guide_ptr = guide_f.ptr<float>(i);
+            for (int j = 0; j < output.cols; j++) {
+                int x0 = std::min(j/2, coarse_f.cols-1), x1 = std::min(x0+1, coarse_f.cols-1);
+                float fx = 0.5f*float(j - 2*x0);
+                int ys[2] = {y0, y1}, xs[2] = {x0, x1};
+                float wy[2] = {1.0f-fy, fy}, wx[2] = {1.0f-fx, fx};
+                float g = guide_ptr[j], sum = 0.0f, norm = 0.0f, bilinear = 0.0f;
+                for (int a = 0; a < 2; a++)
+                    for (int b = 0; b < 2; b++) {
+                        float v = coarse_f(ys[a], xs[b]);
+                        float ws = wy[a]*wx[b];
+                        int gy = std::min(2*ys[a], guide_f.rows-1), gx = std::min(2*xs[b], guide_f.cols-1);
+                        int d = std::min(int(fabs(g - guide_f(gy, gx))), 255);
+                        float w = ws*range_tab[d];
+                        sum += w*v;
+                        norm += w;
+                        bilinear += ws*v;
+                    }
+                out_ptr[j] = (norm > 1e-6f) ? sum/norm : bilinear;
+            }
+        }
+    }
+
     //-------------------- Parallel Computation attempt ------------------------
     
     struct parallelInvoker{
@@ -12,6 +12,7 @@
 #include "globalPb.h"
 #include "buildW.h"
 #include "normCut.h"
+#include "watershed.h"
 
 using namespace std;
 
@@ -53,6 +54,493 @@ namespace
     }
     return weights;
   }
+
+  // 8-bit sRGB to linear RGB, and the Lab f(t) = t^(1/3) sampled on [0, 1]
+  // (X/Xn, Y and Z/Zn never leave that range for 8-bit input).
+  static const int LAB_CBRT_TAB_SIZE = 1024;
+
+  struct LabTables
+  {
+    float gamma[256];
+    float cbrt[LAB_CBRT_TAB_SIZE+2];
+
+    LabTables()
+    {
+      for(int i=0; i<256; i++){
+	double x = double(i)/255.0;
+	gamma[i] = float((x <= 0.04045) ? x/12.92 : pow((x+0.055)/1.055, 2.4));
+      }
+      for(int i=0; i<LAB_CBRT_TAB_SIZE+2; i++){
+	double t = double(i)/double(LAB_CBRT_TAB_SIZE);
+	cbrt[i] = float((t > 0.008856) ? pow(t, 1.0/3.0) : 7.787*t + 16.0/116.0);
+      }
+    }
+  };
+
+  static const LabTables & 
+  _lab_Tables()
+  {
+    static const LabTables tables;
+    return tables;
+  }
+
+  static inline float
+  _lab_F(const LabTables & tab, float t)
+  {
+    float x = t*float(LAB_CBRT_TAB_SIZE);
+    int i = int(x);
+    if(i < 0) i = 0;
+    else if(i > LAB_CBRT_TAB_SIZE-1) i = LAB_CBRT_TAB_SIZE-1;
+    float frac = x - float(i);
+    return tab.cbrt[i] + frac*(tab.cbrt[i+1] - tab.cbrt[i]);
+  }
+
+  static inline uchar
+  _quantize_Bin(float v, int num_bins)
+  {
+    if(v < 0.0f) v = 0.0f;
+    else if(v > 1.0f) v = 1.0f;
+    int bin = int(v*float(num_bins));
+    if(bin == num_bins) bin--;
+    return uchar(bin);
+  }
+
+  // bfloat16 storage: the upper half of an IEEE float, rounded to nearest
+  // even. Maps are kept as CV_16UC1 and widened back to float on use.
+  static inline ushort
+  _float_To_bf16(float f)
+  {
+    unsigned int u;
+    memcpy(&u, &f, sizeof(u));
+    u += 0x7FFF + ((u >> 16) & 1);
+    return ushort(u >> 16);
+  }
+
+  static inline float
+  _bf16_To_float(ushort h)
+  {
+    unsigned int u = (unsigned int)(h) << 16;
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+  }
+
+  static void
+  _pack_Half(const cv::Mat & src, cv::Mat & dst)
+  {
+    cv::Mat packed(src.rows, src.cols, CV_16UC1);
+    for(int i=0; i<src.rows; i++){
+      const float *src_ptr = src.ptr<float>(i);
+      ushort *dst_ptr = packed.ptr<ushort>(i);
+      for(int j=0; j<src.cols; j++)
+	dst_ptr[j] = _float_To_bf16(src_ptr[j]);
+    }
+    dst = packed;
+  }
+
+  // float maps are passed through without a copy
+  static void
+  _widen_Half(const cv::Mat & src, cv::Mat & dst)
+  {
+    if(src.type() != CV_16UC1){
+      dst = src;
+      return;
+    }
+    dst.create(src.rows, src.cols, CV_32FC1);
+    for(int i=0; i<src.rows; i++){
+      const ushort *src_ptr = src.ptr<ushort>(i);
+      float *dst_ptr = dst.ptr<float>(i);
+      for(int j=0; j<src.cols; j++)
+	dst_ptr[j] = _bf16_To_float(src_ptr[j]);
+    }
+  }
+
+  // acc += weight*src, for either float or bfloat16 src
+  static void
+  _accumulate_Weighted(cv::Mat & acc, const cv::Mat & src, double weight)
+  {
+    if(src.type() != CV_16UC1){
+      cv::addWeighted(acc, 1.0, src, weight, 0.0, acc);
+      return;
+    }
+    float w = float(weight);
+    for(int i=0; i<acc.rows; i++){
+      const ushort *src_ptr = src.ptr<ushort>(i);
+      float *acc_ptr = acc.ptr<float>(i);
+      for(int j=0; j<acc.cols; j++)
+	acc_ptr[j] += w*_bf16_To_float(src_ptr[j]);
+    }
+  }
+
+  // every other pixel of src, from (0,0): coarse pixel (y,x) is fine
+  // pixel (2y,2x), as jointBilateralUpsample expects
+  static void
+  _decimate_2(const cv::Mat & src, cv::Mat & dst)
+  {
+    size_t elem = src.elemSize();
+    dst.create((src.rows+1)/2, (src.cols+1)/2, src.type());
+    for(int i=0; i<dst.rows; i++){
+      const uchar *src_ptr = src.ptr<uchar>(2*i);
+      uchar *dst_ptr = dst.ptr<uchar>(i);
+      for(int j=0; j<dst.cols; j++)
+	memcpy(dst_ptr + j*elem, src_ptr + 2*j*elem, elem);
+    }
+  }
+
+  // A channel is worth computing only if some consumer (mPb or gPb)
+  // gives it a non-zero weight.
+  static bool* 
+  _active_Channels(int nChannels)
+  {
+    bool *active = new bool[12];
+    double *mPb_weights = _mPb_Weights(nChannels);
+    double *gPb_weights = _gPb_Weights(nChannels);
+    for(size_t ch=0; ch<12; ch++)
+      active[ch] = (mPb_weights[ch] != 0.0) || (gPb_weights[ch] != 0.0);
+    delete[] mPb_weights;
+    delete[] gPb_weights;
+    return active;
+  }
+
+  // sPb_raw of the normalized cut of mPb.  with levels > 0 the same
+  // problem is first solved on a 2x max-pooled mPb (recursively) and its
+  // upsampled eigenvectors seed the eigensolver at this resolution.
+  static void
+  _spectral_Raw(const cv::Mat & mPb, int levels, int storage,
+		const cv::AffinityOptions & affinity,
+		const cv::NCutOptions & options,
+		vector<cv::Mat> & sPb_raw)
+  {
+    vector<cv::Mat> start;
+    if(levels > 0 && mPb.rows >= 64 && mPb.cols >= 64){
+      // max pooling keeps thin boundaries at full strength
+      cv::Mat coarse((mPb.rows+1)/2, (mPb.cols+1)/2, CV_32FC1);
+      for(int y=0; y<coarse.rows; y++)
+	for(int x=0; x<coarse.cols; x++){
+	  float m = 0.0f;
+	  for(int dy=0; dy<2 && 2*y+dy<mPb.rows; dy++)
+	    for(int dx=0; dx<2 && 2*x+dx<mPb.cols; dx++)
+	      m = std::max(m, mPb.at<float>(2*y+dy, 2*x+dx));
+	  coarse.at<float>(y,x) = m;
+	}
+      vector<cv::Mat> coarse_raw;
+      _spectral_Raw(coarse, levels-1, storage, affinity, options, coarse_raw);
+      start.resize(coarse_raw.size());
+      for(size_t i=0; i<coarse_raw.size(); i++)
+	cv::resize(coarse_raw[i], start[i], mPb.size(), 0, 0, cv::INTER_LINEAR);
+    }
+
+    cout<<"eigensolve at "<<mPb.cols<<"x"<<mPb.rows<<" ... "<<endl;
+    LinearOperator *W;
+    double *D;
+    cv::buildW(mPb, W, D, storage, affinity);
+    cv::normalise_cut(*W, mPb.rows, mPb.cols, D, 17, sPb_raw, options,
+		      start.empty() ? NULL : &start);
+    delete W;
+    delete[] D;
+  }
+
+  // GPB_ANYTIME_SPB: seconds of eigensolve, and the part of the converged
+  // eigenvectors' sPb weight below which the next one is not waited for
+  static const double SPB_TIME_BUDGET = 5.0;
+  static const double SPB_MIN_CONTRIBUTION = 0.05;
+
+  // grid spacing of the superpixel seeds, in pixels
+  static const int SPB_SUPERPIXEL_STEP = 6;
+
+  // sPb_raw at each pixel from the superpixel planes: the values of its
+  // superpixel and of the neighbouring ones, weighted by the distance to
+  // their centroids and by their affinity to the pixel's superpixel
+  struct parallelInvoker_lift{
+    const cv::Mat * labels_ptr;
+    const cv::SuperpixelGraph * graph_ptr;
+    const vector<cv::Mat> * raw_ptr;
+    vector<cv::Mat> * sPb_raw_ptr;
+    double sigma;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      const cv::Mat & labels = * labels_ptr;
+      const cv::SuperpixelGraph & graph = * graph_ptr;
+      const vector<cv::Mat> & raw = * raw_ptr;
+      vector<cv::Mat> & sPb_raw = * sPb_raw_ptr;
+      int nvec = raw.size();
+      vector<const float*> in(nvec);
+      vector<float*> out(nvec);
+      for(int k=0; k<nvec; k++)
+	in[k] = raw[k].ptr<float>(0);
+      vector<int> nb;
+      vector<double> w;
+      double scale = 1.0/(2.0*sigma*sigma);
+
+      for(int y=range.begin(); y<range.end(); y++){
+	const int *l = labels.ptr<int>(y);
+	for(int k=0; k<nvec; k++)
+	  out[k] = sPb_raw[k].ptr<float>(y);
+	for(int x=0; x<labels.cols; x++){
+	  // -log of the weights, shifted by their minimum before exp
+	  int i = l[x]-1;
+	  nb.assign(1, i);
+	  w.assign(1, ((x-graph.cx[i])*(x-graph.cx[i]) + (y-graph.cy[i])*(y-graph.cy[i]))*scale);
+	  for(int t=graph.start[i]; t<graph.start[i+1]; t++){
+	    int j = graph.adj[t];
+	    nb.push_back(j);
+	    w.push_back(((x-graph.cx[j])*(x-graph.cx[j]) + (y-graph.cy[j])*(y-graph.cy[j]))*scale
+			- log(graph.affinity[t]));
+	  }
+	  double m = *std::min_element(w.begin(), w.end());
+	  double sum = 0.0;
+	  for(size_t t=0; t<w.size(); t++){
+	    w[t] = exp(m - w[t]);
+	    sum += w[t];
+	  }
+	  for(int k=0; k<nvec; k++){
+	    double v = 0.0;
+	    for(size_t t=0; t<nb.size(); t++)
+	      v += w[t]*in[k][nb[t]];
+	    out[k][x] = float(v/sum);
+	  }
+	}
+      }
+    }
+  };
+
+  // sPb_raw from the normalized cut of a superpixel graph of mPb; false,
+  // leaving sPb_raw alone, when there are too few superpixels for it
+  static bool
+  _superpixel_Raw(const cv::Mat & mPb, const cv::NCutOptions & options,
+		  vector<cv::Mat> & sPb_raw)
+  {
+    int nev = 17;
+    cv::Mat scaled, labels;
+    cv::normalize(mPb, scaled, 0.0, 255.0, cv::NORM_MINMAX);
+    cv::watershedGrid(scaled, SPB_SUPERPIXEL_STEP, labels);
+    // images too thin for a seed
+    if(cv::countNonZero(labels) == 0){
+      cout<<"no superpixels, solving on the pixels"<<endl;
+      return false;
+    }
+
+    // the watershed lines join a neighbouring superpixel
+    bool left;
+    do{
+      left = false;
+      for(int y=0; y<labels.rows; y++)
+	for(int x=0; x<labels.cols; x++){
+	  int & l = labels.at<int>(y,x);
+	  if(l) continue;
+	  if(x > 0 && labels.at<int>(y,x-1)) l = labels.at<int>(y,x-1);
+	  else if(y > 0 && labels.at<int>(y-1,x)) l = labels.at<int>(y-1,x);
+	  else if(x+1 < labels.cols && labels.at<int>(y,x+1)) l = labels.at<int>(y,x+1);
+	  else if(y+1 < labels.rows && labels.at<int>(y+1,x)) l = labels.at<int>(y+1,x);
+	  else left = true;
+	}
+    }while(left);
+    double max_label;
+    cv::minMaxIdx(labels, NULL, &max_label);
+    int R = int(max_label);
+    if(R < 8*nev){
+      cout<<"only "<<R<<" superpixels, solving on the pixels"<<endl;
+      return false;
+    }
+
+    cv::SuperpixelGraph graph;
+    SMatrix *W;
+    double *D;
+    cv::buildSuperpixelW(mPb, labels, R, W, D, graph);
+    cout<<"eigensolve on "<<R<<" superpixels, "<<W->nnz<<" nonzeros ... "<<endl;
+
+    // the multigrid preconditioner needs a pixel grid
+    cv::NCutOptions sp_options = options;
+    if(sp_options.precond == NCUT_PRECOND_MULTIGRID)
+      sp_options.precond = NCUT_PRECOND_JACOBI;
+    vector<cv::Mat> raw;
+    cv::normalise_cut(*W, 1, R, D, nev, raw, sp_options);
+    delete W;
+    delete[] D;
+
+    sPb_raw.resize(raw.size());
+    for(size_t k=0; k<raw.size(); k++)
+      sPb_raw[k].create(mPb.rows, mPb.cols, CV_32FC1);
+    parallelInvoker_lift lift;
+    lift.labels_ptr = & labels;
+    lift.graph_ptr = & graph;
+    lift.raw_ptr = & raw;
+    lift.sPb_raw_ptr = & sPb_raw;
+    lift.sigma = SPB_SUPERPIXEL_STEP;
+    cv::parallel_for(cv::BlockedRange(0, mPb.rows), lift);
+    return true;
+  }
+
+#ifdef GPB_MPI
+  // image rows the disc of buildW reaches, the halo of every strip
+  static const int SPB_HALO = 5;
+
+  // what rank 0 broadcasts before each strip solve, followed by mPb
+  struct StripProblem
+  {
+    int rows;   // 0 releases the workers
+    int cols;
+    int mode;
+    double shift;
+    double affinity_tol;
+    double epsilon;
+    double ic_thresh;
+  };
+
+  // this rank's strip of the normalized cut of mPb, all ranks together;
+  // rank 0 receives sPb_raw
+  static void
+  _strip_Raw(const StripProblem & p, const cv::Mat & mPb,
+	     vector<cv::Mat> & sPb_raw)
+  {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    int y0 = (long long)rank*p.rows/size;
+    int y1 = (long long)(rank+1)*p.rows/size;
+    // the rows of the strip and its halo, and the rows their intervening
+    // contours cross, so the strip's rows of W are those of the whole W
+    int e0 = std::max(0, y0-SPB_HALO), e1 = std::min(p.rows, y1+SPB_HALO);
+    int a = std::max(0, y0-2*SPB_HALO), b = std::min(p.rows, y1+2*SPB_HALO);
+
+    cv::AffinityOptions affinity;
+    affinity.epsilon = p.epsilon;
+    affinity.ic_thresh = p.ic_thresh;
+    LinearOperator *Wc;
+    double *Dc;
+    cv::buildW(mPb.rowRange(a, b), Wc, Dc, W_STORAGE_CSR, affinity);
+    SMatrix *S = static_cast<SMatrix*>(Wc);
+
+    // the strip's rows, columns counted from row e0
+    int cols = p.cols;
+    int n = (y1-y0)*cols;
+    int first = (y0-a)*cols, base = (e0-a)*cols;
+    int offset = S->row[first];
+    int nnz = S->row[first+n] - offset;
+    int *row = new int[n+1];
+    int *col = new int[nnz];
+    float *vals = new float[nnz];
+    for(int r=0; r<=n; r++)
+      row[r] = S->row[first+r] - offset;
+    for(int k=0; k<nnz; k++){
+      col[k] = S->col[offset+k] - base;
+      vals[k] = S->values[offset+k];
+    }
+    double *D = new double[n];
+    std::copy(Dc+first, Dc+first+n, D);
+    delete Wc;
+    delete[] Dc;
+
+    StripMatrix W(MPI_COMM_WORLD, cols, y0-e0, e1-y1, n, row, col, vals);
+    cv::NCutOptions options;
+    options.mode = p.mode;
+    options.shift = p.shift;
+    options.affinity_tol = p.affinity_tol;
+    cv::normalise_cut(W, y1-y0, cols, D, 17, sPb_raw, options);
+    delete[] D;
+  }
+
+  // sPb_raw from strips of mPb solved by all ranks; false, leaving sPb_raw
+  // alone, when there is one rank or the strips would be thinner than
+  // their halos
+  static bool
+  _distributed_Raw(const cv::Mat & mPb, const cv::AffinityOptions & affinity,
+		   const cv::NCutOptions & options, vector<cv::Mat> & sPb_raw)
+  {
+    int size;
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if(size < 2)
+      return false;
+    if(mPb.rows/size < SPB_HALO){
+      cout<<"too few rows for "<<size<<" strips, solving on rank 0"<<endl;
+      return false;
+    }
+    if(affinity.long_range > 0)
+      cout<<"no long-range links in strips"<<endl;
+
+    StripProblem p;
+    p.rows = mPb.rows;
+    p.cols = mPb.cols;
+    p.mode = options.mode;
+    p.shift = options.shift;
+    p.affinity_tol = options.affinity_tol;
+    p.epsilon = affinity.epsilon;
+    p.ic_thresh = affinity.ic_thresh;
+    cv::Mat m = mPb.isContinuous() ? mPb : mPb.clone();
+    MPI_Bcast(&p, sizeof(p), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(m.ptr<float>(0), p.rows*p.cols, MPI_FLOAT, 0, MPI_COMM_WORLD);
+    cout<<"eigensolve at "<<p.cols<<"x"<<p.rows<<" in "<<size<<" strips ... "<<endl;
+    _strip_Raw(p, m, sPb_raw);
+    return true;
+  }
+#endif
+
+  // relative parts of the oriented filters' energy the steered sPb may
+  // drop: the basis leaves out at most STEER_BASIS_TOL, the separable
+  // split of each basis kernel at most STEER_SEPARABLE_TOL
+  static const double STEER_BASIS_TOL = 2e-3;
+  static const double STEER_SEPARABLE_TOL = 3e-4;
+
+  // filters[i] ~ sum_t coef(i, basis[t]) * ky[t] kx[t]^T.  the filters are
+  // elongated, so two x/y derivative kernels do not steer them exactly;
+  // the basis comes from the SVD of the filters instead, and each basis
+  // kernel is split into rank-one (separable) terms by its own SVD.
+  struct SteerTerms
+  {
+    cv::Mat coef;               // n_ori x nbasis, CV_64FC1
+    vector<int> basis;
+    vector<cv::Mat> kx, ky;
+  };
+
+  static void
+  _steer_Terms(const vector<cv::Mat> & filters,
+	       SteerTerms & terms)
+  {
+    int n_ori = filters.size();
+    int kh = filters[0].rows, kw = filters[0].cols;
+    cv::Mat F(n_ori, kh*kw, CV_64FC1);
+    for(int i=0; i<n_ori; i++){
+      cv::Mat k;
+      cv::Mat row = F.row(i);
+      filters[i].convertTo(k, CV_64F);
+      k.reshape(1, 1).copyTo(row);
+    }
+    cv::SVD svd(F);
+    double total = 0.0;
+    for(int k=0; k<svd.w.rows; k++)
+      total += svd.w.at<double>(k)*svd.w.at<double>(k);
+
+    int nbasis = 0;
+    double rest = total;
+    while(nbasis < svd.w.rows && rest > STEER_BASIS_TOL*total){
+      rest -= svd.w.at<double>(nbasis)*svd.w.at<double>(nbasis);
+      nbasis++;
+    }
+
+    terms.coef.create(n_ori, nbasis, CV_64FC1);
+    for(int i=0; i<n_ori; i++)
+      for(int k=0; k<nbasis; k++)
+	terms.coef.at<double>(i,k) = svd.u.at<double>(i,k)*svd.w.at<double>(k);
+    terms.basis.clear();
+    terms.kx.clear();
+    terms.ky.clear();
+    for(int k=0; k<nbasis; k++){
+      // unit norm basis kernel, and the energy it carries
+      cv::SVD split(svd.vt.row(k).reshape(1, kh));
+      double weight = svd.w.at<double>(k)*svd.w.at<double>(k);
+      double left = 1.0;
+      for(int t=0; t<split.w.rows && weight*left > STEER_SEPARABLE_TOL*total; t++){
+	cv::Mat kx, ky;
+	split.vt.row(t).reshape(1, kw).convertTo(kx, CV_32F);
+	split.u.col(t).convertTo(ky, CV_32F, split.w.at<double>(t));
+	terms.kx.push_back(kx);
+	terms.ky.push_back(ky);
+	terms.basis.push_back(k);
+	left -= split.w.at<double>(t)*split.w.at<double>(t);
+      }
+    }
+  }
 }
 
 namespace cv
@@ -97,9 +585,85 @@ namespace cv
     cv::parallel_for(range, parallel);
   }
 
+  struct parallelInvoker_lab{
+    const vector<cv::Mat> * bgr_ptr;
+    vector<cv::Mat> * labels_ptr;
+    cv::Mat * grey_ptr;
+    int num_bins;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      const vector<cv::Mat> & bgr = * bgr_ptr;
+      vector<cv::Mat> & labels = * labels_ptr;
+      cv::Mat & grey = * grey_ptr;
+      const LabTables & tab = _lab_Tables();
+
+      for(int i=range.begin(); i<range.end(); i++){
+	const uchar *b_ptr = bgr[0].ptr<uchar>(i);
+	const uchar *g_ptr = bgr[1].ptr<uchar>(i);
+	const uchar *r_ptr = bgr[2].ptr<uchar>(i);
+	uchar *l_ptr = labels[0].ptr<uchar>(i);
+	uchar *a_ptr = labels[1].ptr<uchar>(i);
+	uchar *bb_ptr = labels[2].ptr<uchar>(i);
+	uchar *grey_ptr = grey.ptr<uchar>(i);
+	for(int j=0; j<grey.cols; j++){
+	  // same fixed point weights as CV_BGR2GRAY
+	  grey_ptr[j] = uchar((b_ptr[j]*1868 + g_ptr[j]*9617 + r_ptr[j]*4899 + (1<<13)) >> 14);
+
+	  float b = tab.gamma[b_ptr[j]];
+	  float g = tab.gamma[g_ptr[j]];
+	  float r = tab.gamma[r_ptr[j]];
+	  float X = (0.412453f*r + 0.357580f*g + 0.180423f*b)*(1.0f/0.950456f);
+	  float Y =  0.212671f*r + 0.715160f*g + 0.072169f*b;
+	  float Z = (0.019334f*r + 0.119193f*g + 0.950227f*b)*(1.0f/1.088754f);
+	  float fX = _lab_F(tab, X), fY = _lab_F(tab, Y), fZ = _lab_F(tab, Z);
+
+	  float L = (Y > 0.008856f) ? (116.0f*fY - 16.0f) : (903.3f*Y);
+	  l_ptr[j]  = _quantize_Bin(L/100.0f, num_bins);
+	  a_ptr[j]  = _quantize_Bin((500.0f*(fX - fY) + 73.0f)/168.0f, num_bins);
+	  bb_ptr[j] = _quantize_Bin((200.0f*(fY - fZ) + 73.0f)/168.0f, num_bins);
+	}
+      }
+    }
+  };
+
+  void
+  lab_quantize(const vector<cv::Mat> & layers,
+	       int num_bins,
+	       vector<cv::Mat> & labels,
+	       cv::Mat & grey)
+  {
+    vector<cv::Mat> bgr(3);
+    for(size_t c=0; c<3; c++)
+      if(layers[c].depth() == CV_8U)
+	bgr[c] = layers[c];
+      else
+	layers[c].convertTo(bgr[c], CV_8U);
+
+    int rows = bgr[0].rows, cols = bgr[0].cols;
+    labels.resize(3);
+    for(size_t c=0; c<3; c++)
+      labels[c].create(rows, cols, CV_8UC1);
+    grey.create(rows, cols, CV_8UC1);
+
+    // build the tables once, outside of the workers
+    _lab_Tables();
+
+    parallelInvoker_lab parallel;
+    parallel.bgr_ptr = & bgr;
+    parallel.labels_ptr = & labels;
+    parallel.grey_ptr = & grey;
+    parallel.num_bins = num_bins;
+
+    cv::BlockedRange range(0, rows);
+    cv::parallel_for(range, parallel);
+  }
+
   void
   pb_parts_final_selected(vector<cv::Mat> & layers,
-			  vector<vector<cv::Mat> > & gradients)
+			  vector<vector<cv::Mat> > & gradients,
+			  const bool* active,
+			  int flags)
   {
     int n_ori  = 8;                           // number of orientations
     int length = 7;
@@ -114,10 +678,7 @@ namespace cv
     vector<cv::Mat> filters;
         
     filters.resize(3);
-    cv::Mat color, grey, ones;
-    cv::merge(layers, color);
-    cv::cvtColor(color, grey, CV_BGR2GRAY);
-    ones = cv::Mat::ones(color.rows, color.cols, CV_32FC1);
+    cv::Mat grey;
     
     // Histogram filter generation
     cv::gaussianFilter1D(double(bins[0])*bg_smooth_sigma, 0, false, filters[0]);
@@ -127,55 +688,57 @@ namespace cv
     filters[2] = cv::Mat::zeros(1, length, CV_32FC1);
     filters[2].at<float>(0, (length-1)/2) = 1.0;
     
-    // Normalize color channels
-    color.convertTo(color, CV_32FC3);
-    cv::split(color, layers);
-    for(size_t c=0; c<3; c++)
-      cv::multiply(layers[c], ones, layers[c], 1.0/255.0);
-    cv::merge(layers, color);
-    
-    // Color convert, including gamma correction
-    cv::cvtColor(color, color, CV_BGR2Lab);
-
-    // Normalize Lab channels
-    cv::split(color, layers);
-    for(size_t c=0; c<3; c++)
-      for(size_t i=0; i<layers[c].rows; i++){
-	for(size_t j=0; j<layers[c].cols; j++){
-	  if(c==0)
-	    layers[c].at<float>(i,j) = layers[c].at<float>(i,j)/100.0;
-      	  else
-	    layers[c].at<float>(i,j) = (layers[c].at<float>(i,j)+73.0)/168.0;
-	  if(layers[c].at<float>(i,j) < 0.0)
-	    layers[c].at<float>(i,j) = 0.0;
-	  else if(layers[c].at<float>(i,j) > 1.0)
-	    layers[c].at<float>(i,j) = 1.0;
-
-	  //quantize color channels
-	  float bin = floor(layers[c].at<float>(i,j)*float(bins[0]));
-	  if(bin == float(bins[0])) bin--;
-	  layers[c].at<float>(i,j)=bin;
-	}
-      }
+    // Color convert (including gamma correction) and quantize Lab channels
+    vector<cv::Mat> labels;
+    cv::lab_quantize(layers, bins[0], labels, grey);
+    layers.swap(labels);
     layers.resize(4);
 
     /********* END OF FILTERS INTIALIZATION ***************/
-    cout<<" ---  computing texton ... "<<endl;
-    cv::textonRun(grey, layers[3], n_ori, bins[1], sigma_tg_filt_sm, sigma_tg_filt_lg);
+    // channels 3*l .. 3*l+2 are the three radii of layer l
+    bool texton_needed = (active == NULL) || active[9] || active[10] || active[11];
+    if(texton_needed){
+      cout<<" ---  computing texton ... "<<endl;
+      cv::textonRun(grey, layers[3], n_ori, bins[1], sigma_tg_filt_sm, sigma_tg_filt_lg);
+    }
 
     cout<<" ---  computing bg cga cgb tg ... "<<endl;
+    int64 t_start = cv::getTickCount();
+    gradients.clear();
     gradients.resize(layers.size()*3);
     //parallel_for_gradients(layers, filters, gradients, n_ori, bins, radii);
 
-    for(size_t i=0; i<gradients.size(); i++)
-      cv::gradient_hist_2D(layers[i/3], radii[i-((i/3)*3-int(i>2))], n_ori, 
-			   bins[i/9], filters[i/3-int(i>5)], gradients[i]);
+    // large radii only see coarse structure: in approximate mode they are
+    // computed at half resolution and upsampled guided by the grey image
+    vector<cv::Mat> layers_half(layers.size());
+    vector<cv::Mat> gradients_half;
+    
+    // pruned channels are left empty, consumers skip them
+    for(size_t i=0; i<gradients.size(); i++){
+      if(active != NULL && !active[i])
+	continue;
+      int r = radii[i-((i/3)*3-int(i>2))];
+      if((flags & GPB_APPROX_MPB) && r >= 10){
+	if(layers_half[i/3].empty())
+	  _decimate_2(layers[i/3], layers_half[i/3]);
+	cv::gradient_hist_2D(layers_half[i/3], r/2, n_ori, 
+			     bins[i/9], filters[i/3-int(i>5)], gradients_half);
+	gradients[i].resize(n_ori);
+	for(size_t idx=0; idx<n_ori; idx++)
+	  cv::jointBilateralUpsample(gradients_half[idx], grey, gradients[i][idx], 20.0);
+      }
+      else
+	cv::gradient_hist_2D(layers[i/3], r, n_ori, 
+			     bins[i/9], filters[i/3-int(i>5)], gradients[i]);
+      if(flags & GPB_HALF_STORAGE)
+	for(size_t idx=0; idx<gradients[i].size(); idx++)
+	  _pack_Half(gradients[i][idx], gradients[i][idx]);
+    }
+    cout<<" ---  gradients done in "<<double(cv::getTickCount()-t_start)/cv::getTickFrequency()<<" s"<<endl;
   
     //clean up
     filters.clear();
-    color.release();
     grey.release();
-    ones.release();
   }
   
   void
@@ -341,15 +904,18 @@ namespace cv
   void
   multiscalePb(const cv::Mat & image,
 	       cv::Mat & mPb_max,
-	       vector<vector<cv::Mat> > & gradients)  
+	       vector<vector<cv::Mat> > & gradients,
+	       int flags)  
   {
-    cv::Mat kernel, angles, temp;
+    cv::Mat kernel, angles, temp, grad;
     vector<cv::Mat> layers, mPb_all;
     int n_ori = 8;
     int radii[4] ={3, 5, 10, 20};
     double* weights, *ori;
+    bool* active;
     
     weights = _mPb_Weights(image.channels());
+    active  = _active_Channels(image.channels());
     layers.resize(3); 
     if(image.channels() == 3)
       cv::split(image, layers);
@@ -358,16 +924,25 @@ namespace cv
 	image.copyTo(layers[i]);
     
     cout<<"mPb computation commencing ..."<<endl;
-    pb_parts_final_selected(layers, gradients);
+    pb_parts_final_selected(layers, gradients, active, flags);
     
     mPb_all.resize(n_ori);
     ori = cv::standard_filter_orientations(n_ori, RAD);
     for(size_t idx=0; idx<n_ori; idx++){
       mPb_all[idx] = cv::Mat::zeros(image.rows, image.cols, CV_32FC1);
       for(size_t ch = 0; ch<gradients.size(); ch++){
+	if(gradients[ch].empty())
+	  continue;
 	MakeFilter(radii[ch-(ch/3)*3+int(ch>2)], ori[idx], kernel);
-	cv::filter2D(gradients[ch][idx], gradients[ch][idx], CV_32F, kernel, cv::Point(-1, -1), 0, cv::BORDER_REFLECT);
-	cv::addWeighted(mPb_all[idx], 1.0, gradients[ch][idx], weights[ch], 0.0, mPb_all[idx]);	
+	_widen_Half(gradients[ch][idx], grad);
+	cv::filter2D(grad, grad, CV_32F, kernel, cv::Point(-1, -1), 0, cv::BORDER_REFLECT);
+	if(weights[ch] != 0.0)
+	  cv::addWeighted(mPb_all[idx], 1.0, grad, weights[ch], 0.0, mPb_all[idx]);	
+	if(flags & GPB_HALF_STORAGE)
+	  _pack_Half(grad, gradients[ch][idx]);
+	else
+	  gradients[ch][idx] = grad;
+	grad.release();
       }
 
       if(idx == 0){
@@ -390,7 +965,9 @@ namespace cv
     kernel.release();
     angles.release();
     temp.release();
+    grad.release();
     delete[] weights;
+    delete[] active;
     delete[] ori;
     layers.clear();
     mPb_all.clear();
@@ -412,8 +989,11 @@ namespace cv
     gPb_ori.resize(n_ori);
     for(size_t idx=0; idx<n_ori; idx++){
       gPb_ori[idx] = cv::Mat::zeros(mPb_max.rows, mPb_max.cols, CV_32FC1);
-      for(size_t ch=0; ch<gradients.size(); ch++)
-	cv::addWeighted(gPb_ori[idx], 1.0, gradients[ch][idx], weights[ch], 0.0, gPb_ori[idx]);
+      for(size_t ch=0; ch<gradients.size(); ch++){
+	if(weights[ch] == 0.0 || gradients[ch].empty())
+	  continue;
+	_accumulate_Weighted(gPb_ori[idx], gradients[ch][idx], weights[ch]);
+      }
    
       if(idx == 0)
 	gPb_ori[idx].copyTo(gPb);
@@ -455,43 +1035,155 @@ namespace cv
     bwskel.release();
   }
 
+  // sPb[i] += |filters[i] * eigenvector|, steered from the responses of
+  // one eigenvector to the separable terms
+  struct parallelInvoker_steer{
+    const vector<cv::Mat> * responses_ptr;
+    const SteerTerms * terms_ptr;
+    vector<cv::Mat> * sPb_ptr;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      const vector<cv::Mat> & responses = * responses_ptr;
+      const SteerTerms & terms = * terms_ptr;
+      vector<cv::Mat> & sPb = * sPb_ptr;
+      int n_ori = terms.coef.rows, nbasis = terms.coef.cols;
+      int nterms = responses.size();
+      const double *c_ptr = terms.coef.ptr<double>(0);
+      vector<double> coef(c_ptr, c_ptr + n_ori*nbasis);
+      vector<double> b(nbasis);
+      vector<const float*> r_ptr(nterms);
+      vector<float*> s_ptr(n_ori);
+
+      for(int y=range.begin(); y<range.end(); y++){
+	for(int t=0; t<nterms; t++)
+	  r_ptr[t] = responses[t].ptr<float>(y);
+	for(int i=0; i<n_ori; i++)
+	  s_ptr[i] = sPb[i].ptr<float>(y);
+	for(int x=0; x<sPb[0].cols; x++){
+	  for(int k=0; k<nbasis; k++)
+	    b[k] = 0.0;
+	  for(int t=0; t<nterms; t++)
+	    b[terms.basis[t]] += r_ptr[t][x];
+	  for(int i=0; i<n_ori; i++){
+	    double v = 0.0;
+	    for(int k=0; k<nbasis; k++)
+	      v += coef[i*nbasis+k]*b[k];
+	    s_ptr[i][x] += float(fabs(v));
+	  }
+	}
+      }
+    }
+  };
+
+  void
+  steered_sPb(const vector<cv::Mat> & sPb_raw,
+	      const vector<cv::Mat> & filters,
+	      vector<cv::Mat> & sPb)
+  {
+    SteerTerms terms;
+    _steer_Terms(filters, terms);
+    cout<<"steering "<<filters.size()<<" filters from "<<terms.coef.cols
+	<<" basis kernels, "<<terms.kx.size()<<" separable terms"<<endl;
+
+    vector<cv::Mat> responses(terms.kx.size());
+    parallelInvoker_steer parallel;
+    parallel.responses_ptr = & responses;
+    parallel.terms_ptr = & terms;
+    parallel.sPb_ptr = & sPb;
+    for(size_t j=0; j<sPb_raw.size(); j++){
+      for(size_t t=0; t<responses.size(); t++)
+	cv::sepFilter2D(sPb_raw[j], responses[t], CV_32F, terms.kx[t], terms.ky[t],
+			cv::Point(-1,-1), 0.0, cv::BORDER_REFLECT);
+      cv::parallel_for(cv::BlockedRange(0, sPb[0].rows), parallel);
+    }
+  }
+
   void sPb_gen(cv::Mat & mPb_max,
-	       vector<cv::Mat> & sPb)
+	       vector<cv::Mat> & sPb,
+	       int flags,
+	       double max_memory_mb)
   {
     cout<<"sPb computation commencing ... "<<endl;
-    double **W, *D;
-    int n_ori = 8, nnz;
+    int n_ori = 8;
     sPb.resize(n_ori);
   
     vector<cv::Mat> sPb_raw;
-    cv::buildW(mPb_max, W, nnz, D);
-    cv::normalise_cut(W, nnz, mPb_max.rows, mPb_max.cols, D, 17, sPb_raw);
+    int storage = W_STORAGE_CSR;
+    if(flags & GPB_STENCIL_W)
+      storage = W_STORAGE_STENCIL;
+    else if(flags & GPB_SYMMETRIC_W)
+      storage = W_STORAGE_UPPER;
+    cv::AffinityOptions affinity;
+    if(flags & GPB_SPARSE_W){
+      // exp(-(1-C_IC_SS(0.64))/0.1) is about 1e-3, so the early stop only
+      // moves affinities that epsilon drops or that stay below 1e-3
+      affinity.epsilon = 1e-3;
+      affinity.ic_thresh = 0.64;
+    }
+    if(flags & GPB_LONG_RANGE_W)
+      affinity.long_range = 8;
+    cv::NCutOptions options;
+    if(flags & (GPB_LOBPCG | GPB_LOBPCG_JACOBI)){
+      options.solver = NCUT_LOBPCG;
+      if(flags & GPB_LOBPCG_JACOBI)
+	options.precond = NCUT_PRECOND_JACOBI;
+    }
+    if(flags & GPB_NCUT_LA)
+      options.mode = NCUT_MODE_AFFINITY;
+    if(flags & GPB_LEAN_NCUT)
+      options.lean = true;
+    options.max_memory_mb = max_memory_mb;
+    if(flags & GPB_ANYTIME_SPB){
+      options.solver = NCUT_LOBPCG;
+      options.time_budget = SPB_TIME_BUDGET;
+      options.min_contribution = SPB_MIN_CONTRIBUTION;
+    }
+    bool solved = (flags & GPB_SUPERPIXEL_SPB) && _superpixel_Raw(mPb_max, options, sPb_raw);
+#ifdef GPB_MPI
+    if(!solved && (flags & GPB_DISTRIBUTED_SPB))
+      solved = _distributed_Raw(mPb_max, affinity, options, sPb_raw);
+#endif
+    if(!solved)
+      _spectral_Raw(mPb_max, (flags & GPB_WARM_START) ? 2 : 0, storage,
+		    affinity, options, sPb_raw);
     
     vector<cv::Mat> oe_filters;
     cv::gaussianFilters(n_ori, 1.0, 1, HILBRT_OFF, 3.0, oe_filters);
     
-    for(size_t i=0; i<n_ori; i++){
-      sPb[i] = cv::Mat::zeros(mPb_max.rows, mPb_max.cols, CV_32FC1);
-      for(size_t j=0; j<sPb_raw.size(); j++){
-	cv::Mat temp_blur;
-	cv::filter2D(sPb_raw[j], temp_blur, CV_32F, oe_filters[i], 
-		     cv::Point(-1,-1), 0.0, cv::BORDER_REFLECT);
-	cv::addWeighted(sPb[i], 1.0, cv::abs(temp_blur), 1.0, 0.0, sPb[i]);
-	temp_blur.release();
+    if(flags & GPB_STEERED_SPB){
+      for(size_t i=0; i<n_ori; i++)
+	sPb[i] = cv::Mat::zeros(mPb_max.rows, mPb_max.cols, CV_32FC1);
+      steered_sPb(sPb_raw, oe_filters, sPb);
+      if(flags & GPB_HALF_STORAGE)
+	for(size_t i=0; i<n_ori; i++)
+	  _pack_Half(sPb[i], sPb[i]);
+    }else{
+      for(size_t i=0; i<n_ori; i++){
+	sPb[i] = cv::Mat::zeros(mPb_max.rows, mPb_max.cols, CV_32FC1);
+	for(size_t j=0; j<sPb_raw.size(); j++){
+	  cv::Mat temp_blur;
+	  cv::filter2D(sPb_raw[j], temp_blur, CV_32F, oe_filters[i], 
+		       cv::Point(-1,-1), 0.0, cv::BORDER_REFLECT);
+	  cv::addWeighted(sPb[i], 1.0, cv::abs(temp_blur), 1.0, 0.0, sPb[i]);
+	  temp_blur.release();
+	}
+	if(flags & GPB_HALF_STORAGE)
+	  _pack_Half(sPb[i], sPb[i]);
       }
     }
     //clean up
     oe_filters.clear();
     sPb_raw.clear();
-    delete[] W;
-    delete[] D;
   }
 
   void 
   globalPb(const cv::Mat & image,
 	   cv::Mat & gPb,
 	   cv::Mat & gPb_thin,
-	   vector<cv::Mat> & gPb_ori)
+	   vector<cv::Mat> & gPb_ori,
+	   int flags,
+	   double max_memory_mb)
   {
     gPb = cv::Mat::zeros(image.rows, image.cols, CV_32FC1);
     cv::Mat mPb_max;
@@ -501,11 +1193,11 @@ namespace cv
     weights = _gPb_Weights(image.channels());
 
     //multiscalePb - mPb
-    multiscalePb(image, mPb_max, gradients);
+    multiscalePb(image, mPb_max, gradients, flags);
     //mPb_max.copyTo(gPb);
     
     //spectralPb   - sPb
-    sPb_gen(mPb_max, sPb);
+    sPb_gen(mPb_max, sPb, flags, max_memory_mb);
     
     //globalPb - gPb
     gPb_gen(mPb_max, weights, sPb, gradients, gPb_ori, gPb_thin, gPb);
@@ -515,4 +1207,29 @@ namespace cv
     gradients.clear();
     delete[] weights;
   }
+
+#ifdef GPB_MPI
+  void
+  sPb_worker()
+  {
+    while(true){
+      StripProblem p;
+      MPI_Bcast(&p, sizeof(p), MPI_BYTE, 0, MPI_COMM_WORLD);
+      if(p.rows == 0)
+	break;
+      cv::Mat mPb(p.rows, p.cols, CV_32FC1);
+      MPI_Bcast(mPb.ptr<float>(0), p.rows*p.cols, MPI_FLOAT, 0, MPI_COMM_WORLD);
+      vector<cv::Mat> sPb_raw;
+      _strip_Raw(p, mPb, sPb_raw);
+    }
+  }
+
+  void
+  sPb_release_workers()
+  {
+    StripProblem p;
+    memset(&p, 0, sizeof(p));
+    MPI_Bcast(&p, sizeof(p), MPI_BYTE, 0, MPI_COMM_WORLD);
+  }
+#endif
 }
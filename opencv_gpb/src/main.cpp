@@ -11,10 +11,14 @@
 
 #include "globalPb.h"
 #include "contour2ucm.h"
+#ifdef GPB_MPI
+#include <mpi.h>
+#endif
 
 using namespace std;
 
 cv::Mat markers, ucm2, bd, ll;
+cv::MergeTree tree;
 cv::Point prev_pt(-1, -1);
 int thres;
 double c;
@@ -44,12 +48,24 @@ void on_trackbar(int, void* )
 {
   c = (double)thres/100-0.005;
   if(c<0.0) c=0.0;
-  cv::ucm2seg(ucm2, bd, ll, c, SINGLE_SIZE);
+  cv::ucm2seg(tree, bd, ll, c);
   cv::imshow("example", bd);
 }
 
 int main(int argc, char** argv){
 
+#ifdef GPB_MPI
+  // every rank but 0 only takes part in the sPb eigensolve
+  MPI_Init(&argc, &argv);
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  if(rank != 0){
+    cv::sPb_worker();
+    MPI_Finalize();
+    return 0;
+  }
+#endif
+
   //info block
   system("clear");
   cout<<"(before running it, roughly mark the areas on the ucm window)"<<endl;
@@ -62,11 +78,18 @@ int main(int argc, char** argv){
   vector<cv::Mat> gPb_ori;
 
   img0 = cv::imread(argv[1], -1);
+  // optional cap on the sPb eigensolver memory, in MB
+  double max_memory_mb = (argc > 2) ? atof(argv[2]) : 0.0;
 
-  cv::globalPb(img0, gPb, gPb_thin, gPb_ori);
+#ifdef GPB_MPI
+  cv::globalPb(img0, gPb, gPb_thin, gPb_ori, GPB_DISTRIBUTED_SPB, max_memory_mb);
+  cv::sPb_release_workers();
+#else
+  cv::globalPb(img0, gPb, gPb_thin, gPb_ori, 0, max_memory_mb);
+#endif
 
   // if you wanna conduct interactive segmentation later, choose DOUBLE_SIZE, otherwise SINGLE_SIZE will do either.
-  cv::contour2ucm(gPb, gPb_ori, ucm, SINGLE_SIZE);
+  cv::contour2ucm(gPb, gPb_ori, ucm, SINGLE_SIZE, &tree);
   
   //back up
   markers = cv::Mat::zeros(ucm.size(), CV_8UC1);
@@ -112,4 +135,7 @@ int main(int argc, char** argv){
       cv::imshow("labels", labels*int(255/num_seed));
     }   
   }
+#ifdef GPB_MPI
+  MPI_Finalize();
+#endif
 }
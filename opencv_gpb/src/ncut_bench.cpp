@@ -0,0 +1,98 @@
+//
+//    Compares the sPb eigensolvers on one image: ARPACK and LOBPCG with
+//    each preconditioner, on the same affinity built from the image's mPb.
+//    normalise_cut reports iterations, products with W, wall time and
+//    memory.  the optional cap (MB) applies to every configuration.  the
+//    anytime configurations also report how many eigenpairs they kept.
+//    ARPACK SM and LOBPCG multigrid are then rerun on sparsified affinities
+//    (buildW reports their nonzeros and memory against the full disc).
+//
+//    usage: ncut_bench image [max_memory_mb]
+//
+
+#include "globalPb.h"
+#include "buildW.h"
+#include "normCut.h"
+
+using namespace std;
+
+int main(int argc, char** argv){
+  if(argc < 2){
+    cout<<"usage: "<<argv[0]<<" image [max_memory_mb]"<<endl;
+    return 1;
+  }
+  cv::Mat img0 = cv::imread(argv[1], -1);
+  cv::Mat mPb_max;
+  vector<vector<cv::Mat> > gradients;
+  cv::multiscalePb(img0, mPb_max, gradients);
+  gradients.clear();
+
+  const int nconfigs = 9;
+  const char* names[nconfigs] = {"ARPACK, SM on the Laplacian",
+				 "ARPACK, LA on the normalized affinity",
+				 "LOBPCG, no preconditioner",
+				 "LOBPCG, Jacobi", "LOBPCG, multigrid",
+				 "ARPACK, lean", "LOBPCG, multigrid, lean",
+				 "LOBPCG, multigrid, 5% marginal contribution",
+				 "LOBPCG, multigrid, 1 s budget"};
+  cv::NCutOptions options[nconfigs];
+  options[1].mode = NCUT_MODE_AFFINITY;
+  options[2].solver = NCUT_LOBPCG;
+  options[2].precond = NCUT_PRECOND_NONE;
+  options[3].solver = NCUT_LOBPCG;
+  options[3].precond = NCUT_PRECOND_JACOBI;
+  options[4].solver = NCUT_LOBPCG;
+  options[4].precond = NCUT_PRECOND_MULTIGRID;
+  options[5].lean = true;
+  options[6].solver = NCUT_LOBPCG;
+  options[6].lean = true;
+  options[7].solver = NCUT_LOBPCG;
+  options[7].min_contribution = 0.05;
+  options[8].solver = NCUT_LOBPCG;
+  options[8].time_budget = 1.0;
+  for(int i=0; argc > 2 && i<nconfigs; i++)
+    options[i].max_memory_mb = atof(argv[2]);
+
+  for(int i=0; i<nconfigs; i++){
+#ifdef GPB_NO_ARPACK
+    if(options[i].solver == NCUT_ARPACK)
+      continue;
+#endif
+    // normalise_cut turns W into the Laplacian in place, rebuild it
+    LinearOperator *W;
+    double *D;
+    vector<cv::Mat> sPb_raw;
+    cv::buildW(mPb_max, W, D);
+    cout<<names[i]<<endl<<"  ";
+    cv::normalise_cut(*W, mPb_max.rows, mPb_max.cols, D, 17, sPb_raw, options[i]);
+    delete W;
+    delete[] D;
+  }
+
+  const int ngraphs = 2;
+  const char* graphs[ngraphs] = {"sparsified", "sparsified, long range"};
+  cv::AffinityOptions affinity[ngraphs];
+  for(int g=0; g<ngraphs; g++){
+    affinity[g].epsilon = 1e-3;
+    affinity[g].ic_thresh = 0.64;
+  }
+  affinity[1].long_range = 8;
+  const int solvers[2] = {0, 4};
+  for(int g=0; g<ngraphs; g++)
+    for(int s=0; s<2; s++){
+      int i = solvers[s];
+#ifdef GPB_NO_ARPACK
+      if(options[i].solver == NCUT_ARPACK)
+	continue;
+#endif
+      LinearOperator *W;
+      double *D;
+      vector<cv::Mat> sPb_raw;
+      cout<<names[i]<<", "<<graphs[g]<<endl<<"  ";
+      cv::buildW(mPb_max, W, D, W_STORAGE_CSR, affinity[g]);
+      cv::normalise_cut(*W, mPb_max.rows, mPb_max.cols, D, 17, sPb_raw, options[i]);
+      delete W;
+      delete[] D;
+    }
+  return 0;
+}
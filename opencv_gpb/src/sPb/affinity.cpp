@@ -21,6 +21,10 @@
 #include <string.h>
 #include <iostream>
 #include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <opencv/cv.h>
 
 #include "smatrix.h"
 #include "ic.h"
@@ -51,6 +55,193 @@ namespace Group
     
   }
   
+  //
+  // affinities of pixel (x,y) to every offset of the disc, in the disc's
+  // (u,v) scanline order, from its count (1-ic) entries in scanline order.
+  // offsets falling outside the width x height image get 0.
+  //
+  static void pixelAffinities(const PointIC* ic, const int count,
+                              const int x, const int y,
+                              const int width, const int height,
+                              const float sigma, const float dthresh, float* vals)
+  {
+    int dthreshi = (int)ceil(dthresh);
+
+    int k = 0;
+    int icIndex = 0;        //index into sparse supportMap
+    for (int u = -dthreshi; u <= dthreshi; u++)
+    {
+      int yy = y + u;
+      for (int v = -dthreshi; v <= dthreshi; v++)
+      {
+        int xx = x + v;
+        if (u*u+v*v > dthresh*dthresh) {continue;}
+        if (xx < 0 || xx >= width || yy < 0 || yy >= height) 
+        {
+          vals[k++] = 0.0f;
+          continue;
+        }
+              
+        //increment our index into the support map
+        while( icIndex < count && ic[icIndex].y < yy) 
+        {
+          icIndex++;
+        }
+        while( icIndex < count && ic[icIndex].x < xx) 
+        {
+          icIndex++;
+        }
+
+        float pss = 0.0;     //connection strength
+        if ((u == 0) && (v == 0))
+        {
+          pss = 1.0f;
+        } 
+        else
+        {
+          float icsim = 0.0f;
+          if (icIndex < count &&
+               ic[icIndex].x == xx &&
+                ic[icIndex].y == yy)
+          {
+            icsim = ic[icIndex].sim;
+            icIndex++;
+          }
+          pss = C_IC_SS(1-icsim);
+        }//if (u==0) & (v==0)
+
+        float val = exp( -(1-pss) / sigma);
+        assert((val >= 0.0) && (val <= 1.0));
+        vals[k++] = val;
+      }//for v
+    }//for u
+  }
+
+  static void pixelAffinities(const SupportMap& icmap, const int x, const int y, 
+                              const float sigma, const float dthresh, float* vals)
+  {
+    pixelAffinities(icmap(x,y).data(), icmap(x,y).size(), x, y,
+                    icmap.size(0), icmap.size(1), sigma, dthresh, vals);
+  }
+
+  //
+  // affinity of each (i,j) pair of a range, from the intervening contour
+  // on the line between them
+  //
+  struct parallelInvoker_pairs
+  {
+    const DualLattice* boundaries;
+    const long long* pairs;
+    int n;
+    float sigma;
+    float* vals;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      const int width = boundaries->width;
+      for (int p = range.begin(); p < range.end(); p++)
+      {
+        int i = pairs[p] / n;
+        int j = pairs[p] % n;
+        float icsim = 0.0f;
+        interveningContour(*boundaries, i%width, i/width, j%width, j/width, icsim);
+        float pss = C_IC_SS(1-icsim);
+        vals[p] = exp( -(1-pss) / sigma);
+      }
+    }
+  };
+
+  //
+  // the (u,v) offsets of the disc in the order pixelAffinities uses
+  //
+  static int discOffsets(const float dthresh, std::vector<int>& du, std::vector<int>& dv)
+  {
+    int dthreshi = (int)ceil(dthresh);
+    du.clear();
+    dv.clear();
+    for (int u = -dthreshi; u <= dthreshi; u++)
+    {
+      for (int v = -dthreshi; v <= dthreshi; v++)
+      {
+        if (u*u+v*v > dthresh*dthresh) {continue;}
+        du.push_back(u);
+        dv.push_back(v);
+      }
+    }
+    return (int)du.size();
+  }
+
+  //
+  // intervening contour and affinities for the image rows of a range,
+  // written straight into the CSR arrays (rows preset) or the stencil
+  // planes.  pixels away from the border use the ray template, the rest
+  // the clipped box walk, whose scratch space is allocated once per range.
+  //
+  struct parallelInvoker_affinities
+  {
+    const DualLattice* boundaries;
+    const RayTemplate* rays;
+    int wr;
+    float thresh;
+    float sigma;
+    float dthresh;
+    int K;
+    const int* du;
+    const int* dv;
+    const int* rows;
+    int* col;
+    float* vals;
+    float* weights;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      const int width = boundaries->width;
+      const int height = boundaries->height;
+      Util::Array1D<PointIC> adj;
+      Util::Array2D<PointIC> scanLines;
+      Util::Array1D<int> scanCount;
+      Util::Array1D<PointIC> scratch;
+      Util::Array1D<float> pixel(K);
+      int count = 0;
+
+      for (int y = range.begin(); y < range.end(); y++)
+      {
+        for (int x = 0; x < width; x++)
+        {
+          int row = y*width + x;
+          if (!interveningContour(*boundaries,*rays,thresh,x,y,adj,count))
+          {
+            interveningContour(*boundaries,thresh,x,y,wr,adj,count,
+                               scanLines,scanCount,scratch);
+          }
+          pixelAffinities(adj.data(), count, x, y, width, height,
+                          sigma, dthresh, pixel.data());
+          if (weights)
+          {
+            for (int k = 0; k < K; k++)
+            {
+              weights[(size_t)k*width*height + row] = pixel(k);
+            }
+            continue;
+          }
+          int nz = rows[row];
+          for (int k = 0; k < K; k++)
+          {
+            int xx = x + dv[k];
+            int yy = y + du[k];
+            if (xx >= 0 && xx < width && yy >= 0 && yy < height)
+            {
+              vals[nz] = pixel(k);
+              col[nz] = yy*width + xx;
+              nz++;
+            }
+          }
+          assert(nz == rows[row+1]);
+        }
+      }
+    }
+  };
+
   //
   // compute similarities for the set of "true" pixels in region.  
   // affinity matrix is ordered in scanline order 
@@ -59,103 +250,285 @@ namespace Group
   {
     int width = icmap.size(0);
     int height = icmap.size(1);
+    int numPixels = width*height;
+    int dthreshi = (int)ceil(dthresh);
 
-    //build a scanline order index 
-    int numPixels = 0;
-    Util::Array2D<int> index(width,height);
-    index.init(-1);
-    for (int y = 0; y < height; y++)
+    //every row has at most one entry per offset in the disc
+    int maxnz = 0;
+    for (int u = -dthreshi; u <= dthreshi; u++)
     {
-      for (int x = 0; x < width; x++)
+      for (int v = -dthreshi; v <= dthreshi; v++)
       {
-        index(x,y) = numPixels;
-        numPixels++;
+        if (u*u+v*v <= dthresh*dthresh) {maxnz++;}
       }
     }
 
-    //sparse matrix data
-    int* nz = new int[numPixels];           //number of non-zero entries in each row
-    double** vals = new double*[numPixels];   //the values in each row
-    int** col = new int*[numPixels];        //the column number for each value in the row  
-   
-    int dthreshi = (int)ceil(dthresh);
-    int wd = (2*dthreshi+1);                 //window diameter 
-    Util::Array1D<PointIC> connections(wd*wd);
+    //sparse matrix data, filled row by row in scanline order
+    int* rows = new int[numPixels+1];              //start of each row
+    int* col = new int[(size_t)numPixels*maxnz];   //the column number for each value
+    float* vals = new float[(size_t)numPixels*maxnz]; //the values
+    Util::Array1D<float> pixel(maxnz);
     
-    int row = 0;
-    for (int x = 0; x < width; x++)
+    int nnz = 0;
+    for (int y = 0; y < height; y++)
     {
-        for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
         {
-            row = index(x,y);  //the row we are working on
-            nz[row] = 0;       //connection count for row i
-            int icIndex = 0;        //index into sparse supportMap
+            int row = y*width + x;  //the row we are working on
+            rows[row] = nnz;
+            pixelAffinities(icmap, x, y, sigma, dthresh, pixel.data());
+
+            //fill in entries of sparse matrix, skipping offsets off the image
+            int k = 0;
             for (int u = -dthreshi; u <= dthreshi; u++)
             {
-              int yy = y + u;
               for (int v = -dthreshi; v <= dthreshi; v++)
               {
-                int xx = x + v;
-                if (xx < 0 || xx >= width) {continue;}
-                if (yy < 0 || yy >= height) {continue;}
                 if (u*u+v*v > dthresh*dthresh) {continue;}
-              
-                //increment our index into the support map
-                while( icIndex < icmap(x,y).size() && 
-                       icmap(x,y)(icIndex).y < yy) 
-                {
-                  icIndex++;
-                }
-                while( icIndex < icmap(x,y).size() && 
-                        icmap(x,y)(icIndex).x < xx) 
+                int xx = x + v;
+                int yy = y + u;
+                if (xx >= 0 && xx < width && yy >= 0 && yy < height)
                 {
-                  icIndex++;
+                  vals[nnz] = pixel(k);
+                  col[nnz] = yy*width + xx;
+                  nnz++;
                 }
+                k++;
+              }
+            }
+        }//for x
+    }//for y
+    rows[numPixels] = nnz;
 
+    *affinities = new SMatrix(numPixels,rows,col,vals);
+    (*affinities)->symmetrize();
+  }
 
-                float pss = 0.0;     //connection strength
-                if ((u == 0) && (v == 0))
-                {
-                  pss = 1.0f;
-                } 
-                else
-                {
-                  float icsim = 0.0f;
-                  if (icIndex < icmap(x,y).size() &&
-                       icmap(x,y)(icIndex).x == xx &&
-                        icmap(x,y)(icIndex).y == yy)
-                  {
-                    icsim = icmap(x,y)(icIndex).sim;
-                    icIndex++;
-                  }
-                  pss = C_IC_SS(1-icsim);
-                }//if (u==0) & (v==0)
-
-                connections(nz[row]).x = xx;
-                connections(nz[row]).y = yy;
-                connections(nz[row]).sim = pss;
-                nz[row]++;
-              }//for v
-            }//for u
-
-            //fill in entries of sparse matrix
-            vals[row] = new double[nz[row]];
-            col[row] = new int[nz[row]];
-            for (int j = 0; j < nz[row]; j++)
+  //
+  // same affinities as computeAffinities2, stored as one weight plane per
+  // disc offset
+  //
+  void computeAffinitiesStencil(const SupportMap& icmap, const float sigma, const float dthresh, StencilMatrix** affinities)
+  {
+    int width = icmap.size(0);
+    int height = icmap.size(1);
+    StencilMatrix* S = new StencilMatrix(width, height, dthresh);
+    Util::Array1D<float> pixel(S->K);
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int i = y*width + x;
+            pixelAffinities(icmap, x, y, sigma, dthresh, pixel.data());
+            for (int k = 0; k < S->K; k++)
             {
-              float val = exp( -(1-connections(j).sim) / sigma);
-              assert((val >= 0.0) && (val <= 1.0));
-              vals[row][j] = val;
-              col[row][j] = index(connections(j).x,connections(j).y);
+              S->weights[(size_t)k*S->n + i] = pixel(k);
             }
-        }//for y
-    }//for x
+        }
+    }
+
+    S->symmetrize();
+    *affinities = S;
+  }
+
+  //
+  // computeSupport and computeAffinities2 in one parallel pass over the
+  // image rows: the rows of the CSR matrix are laid out from the geometry
+  // alone, so each pixel's intervening contour is turned into its finished
+  // row in place, with no support map in between.
+  //
+  void computeAffinities2(const DualLattice& boundaries, const int wr, const float thresh,
+                          const float sigma, const float dthresh, SMatrix** affinities)
+  {
+    int width = boundaries.width;
+    int height = boundaries.height;
+    int numPixels = width*height;
+    std::vector<int> du, dv;
+    const int K = discOffsets(dthresh, du, dv);
 
-    *affinities = new SMatrix(numPixels,nz,col,vals);
+    //each row holds the offsets of the disc that stay on the image
+    int* rows = new int[numPixels+1];
+    int nnz = 0;
+    for (int y = 0; y < height; y++)
+    {
+      for (int x = 0; x < width; x++)
+      {
+        rows[y*width + x] = nnz;
+        for (int k = 0; k < K; k++)
+        {
+          int xx = x + dv[k];
+          int yy = y + du[k];
+          if (xx >= 0 && xx < width && yy >= 0 && yy < height) {nnz++;}
+        }
+      }
+    }
+    rows[numPixels] = nnz;
+    int* col = new int[nnz];
+    float* vals = new float[nnz];
+
+    RayTemplate rays;
+    buildRayTemplate(boundaries, wr, rays);
+
+    parallelInvoker_affinities parallel;
+    parallel.boundaries = &boundaries;
+    parallel.rays = &rays;
+    parallel.wr = wr;
+    parallel.thresh = thresh;
+    parallel.sigma = sigma;
+    parallel.dthresh = dthresh;
+    parallel.K = K;
+    parallel.du = &du[0];
+    parallel.dv = &dv[0];
+    parallel.rows = rows;
+    parallel.col = col;
+    parallel.vals = vals;
+    parallel.weights = NULL;
+    cv::parallel_for(cv::BlockedRange(0, height), parallel);
+
+    *affinities = new SMatrix(numPixels,rows,col,vals);
     (*affinities)->symmetrize();
   }
 
-} //namespace Group
+  //
+  // the same into the planes of a StencilMatrix
+  //
+  void computeAffinitiesStencil(const DualLattice& boundaries, const int wr, const float thresh,
+                                const float sigma, const float dthresh, StencilMatrix** affinities)
+  {
+    StencilMatrix* S = new StencilMatrix(boundaries.width, boundaries.height, dthresh);
 
+    RayTemplate rays;
+    buildRayTemplate(boundaries, wr, rays);
 
+    parallelInvoker_affinities parallel;
+    parallel.boundaries = &boundaries;
+    parallel.rays = &rays;
+    parallel.wr = wr;
+    parallel.thresh = thresh;
+    parallel.sigma = sigma;
+    parallel.dthresh = dthresh;
+    parallel.K = S->K;
+    parallel.du = S->du;
+    parallel.dv = S->dv;
+    parallel.rows = NULL;
+    parallel.col = NULL;
+    parallel.vals = NULL;
+    parallel.weights = S->weights;
+    cv::parallel_for(cv::BlockedRange(0, boundaries.height), parallel);
 
+    S->symmetrize();
+    *affinities = S;
+  }
+
+  //
+  // link every pixel to count random others further than dthresh but
+  // within radius, as in Shi and Malik's sampled affinities, and merge
+  // the links of affinity >= epsilon into the rows of a symmetric CSR
+  // affinity.  the sampling is seeded, so W is the same on every run.
+  // leaves the affinity as it is if radius <= dthresh.
+  //
+  void addLongRangeAffinities(const DualLattice& boundaries, const int count, const int radius,
+                              const float sigma, const float dthresh, const float epsilon,
+                              SMatrix** affinities)
+  {
+    int width = boundaries.width;
+    int height = boundaries.height;
+    int n = width*height;
+
+    // no offset lies in the annulus
+    if (count <= 0 || radius <= dthresh) {return;}
+
+    std::vector<long long> pairs;
+    pairs.reserve((size_t)n*count);
+    cv::RNG rng(0x5eed);
+    for (int i = 0; i < n; i++)
+    {
+      int x = i%width, y = i/width;
+      for (int s = 0; s < count; s++)
+      {
+        int u, v;
+        do {
+          u = rng.uniform(-radius, radius+1);
+          v = rng.uniform(-radius, radius+1);
+        } while (u*u+v*v <= dthresh*dthresh || u*u+v*v > radius*radius);
+        int xx = x + v, yy = y + u;
+        if (xx < 0 || xx >= width || yy < 0 || yy >= height) {continue;}
+        int j = yy*width + xx;
+        pairs.push_back((long long)std::min(i,j)*n + std::max(i,j));
+      }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+    std::vector<float> pvals(pairs.size());
+    parallelInvoker_pairs parallel;
+    parallel.boundaries = &boundaries;
+    parallel.pairs = pairs.empty() ? NULL : &pairs[0];
+    parallel.n = n;
+    parallel.sigma = sigma;
+    parallel.vals = pvals.empty() ? NULL : &pvals[0];
+    cv::parallel_for(cv::BlockedRange(0, (int)pairs.size()), parallel);
+
+    //the links kept, in both rows; (i,j) come sorted by i then j, so the
+    //rows fill in column order for j > i and, by a second pass, for j < i
+    SMatrix* A = *affinities;
+    std::vector<int> extra(n+1, 0);
+    for (size_t p = 0; p < pairs.size(); p++)
+    {
+      if (pvals[p] < epsilon) {continue;}
+      extra[pairs[p] / n]++;
+      extra[pairs[p] % n]++;
+    }
+    int* rows = new int[n+1];
+    rows[0] = 0;
+    for (int r = 0; r < n; r++)
+    {
+      rows[r+1] = rows[r] + (A->row[r+1] - A->row[r]) + extra[r];
+    }
+    std::vector<int> lcol(rows[n] - A->nnz);
+    std::vector<float> lval(rows[n] - A->nnz);
+    std::vector<int> lstart(n+1, 0);
+    for (int r = 0; r < n; r++)
+    {
+      lstart[r+1] = lstart[r] + extra[r];
+    }
+    std::vector<int> lfill(lstart.begin(), lstart.end()-1);
+    for (int pass = 0; pass < 2; pass++)
+    {
+      for (size_t p = 0; p < pairs.size(); p++)
+      {
+        if (pvals[p] < epsilon) {continue;}
+        int i = pairs[p] / n, j = pairs[p] % n;
+        int r = pass ? i : j;
+        lcol[lfill[r]] = pass ? j : i;
+        lval[lfill[r]++] = pvals[p];
+      }
+    }
+
+    //merge them with the disc entries, both sorted by column
+    int* col = new int[rows[n]];
+    float* vals = new float[rows[n]];
+    for (int r = 0; r < n; r++)
+    {
+      int a = A->row[r], b = lstart[r], k = rows[r];
+      while (a < A->row[r+1] || b < lstart[r+1])
+      {
+        if (b == lstart[r+1] || (a < A->row[r+1] && A->col[a] < lcol[b]))
+        {
+          col[k] = A->col[a];
+          vals[k++] = A->values[a++];
+        }
+        else
+        {
+          col[k] = lcol[b];
+          vals[k++] = lval[b++];
+        }
+      }
+    }
+
+    delete A;
+    *affinities = new SMatrix(n,rows,col,vals);
+  }
+
+} //namespace Group
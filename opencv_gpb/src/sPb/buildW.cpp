@@ -4,53 +4,167 @@ using namespace std;
 
 namespace cv
 {
-  void buildW(const cv::Mat & input, double** &T, int & wz, double* &D)
+  void buildW(const cv::Mat & input, LinearOperator* &W, double* &D,
+	      int storage, const AffinityOptions & options)
   {
     int dthresh = 5;
     float sigma = 0.1;
 
     // copy edge info into lattice struct
     Group::DualLattice boundaries; 
-    cv::copyMakeBorder(input, boundaries.H, 1, 0, 0, 0, cv::BORDER_CONSTANT, 0.0);
-    cv::copyMakeBorder(input, boundaries.V, 0, 0, 1, 0, cv::BORDER_CONSTANT, 0.0);
-    cv::transpose(boundaries.H, boundaries.H);
-    cv::transpose(boundaries.V, boundaries.V);
-    boundaries.width = boundaries.H.rows;
-    boundaries.height = boundaries.V.cols;
-
-    Group::SupportMap ic;
-    Group::computeSupport(boundaries,dthresh,1.0f,ic);
-
-    SMatrix* W = NULL;
-    Group::computeAffinities2(ic,sigma,dthresh,&W);
-    
-    //output assignment
-    wz = 0;
-    for(size_t i=0; i<W->n; i++)
-      wz += W->nz[i];    
+    Group::buildDualLattice(input, boundaries);
+
+    // intervening contours and affinities in one pass, no support map
+    W = NULL;
+    if(storage == W_STORAGE_STENCIL){
+      StencilMatrix *S = NULL;
+      Group::computeAffinitiesStencil(boundaries,dthresh,1.0f,sigma,dthresh,&S);
+      W = S;
+    }else{
+      SMatrix *S = NULL;
+      Group::computeAffinities2(boundaries,dthresh,options.ic_thresh,sigma,dthresh,&S);
+      long long full = S->nnz;
+      if(options.epsilon > 0.0f)
+	S->sparsify(options.epsilon);
+      if(options.long_range > 0)
+	Group::addLongRangeAffinities(boundaries,options.long_range,options.long_radius,
+				      sigma,dthresh,options.epsilon,&S);
+      if(options.epsilon > 0.0f || options.long_range > 0){
+	double mb = 1.0/(1<<20);
+	cout<<"affinity: "<<S->nnz<<" nonzeros, "
+	    <<(S->nnz*8.0 + (S->n+1)*4.0)*mb<<" MB (full disc: "<<full<<", "
+	    <<(full*8.0 + (S->n+1)*4.0)*mb<<" MB)"<<endl;
+      }
+      if(storage == W_STORAGE_UPPER)
+	S->dropLower();
+      W = S;
+    }
     
-    T = new double*[wz];
+    //square root of the degree matrix
     D = new double[W->n];
-    int ct = 0;   
-    for(size_t row = 0; row < W->n; row++){
-      //initialize diag matrix.
-      //int diag_ind = 0;
-      for(size_t i=0; i<W->nz[row]; i++){
-	//initialize sparse matrix.
-	//if(row == W->col[row][i])
-	//diag_ind = i;
-	T[ct+i] = new double[3];
-	//fill sparse matrix.
-	T[ct+i][0] = static_cast<double>(row);
-	T[ct+i][1] = static_cast<double>(W->col[row][i]);
-	T[ct+i][2] = static_cast<double>(W->values[row][i]);
-	//calculate sparse diagnoal matrix
-	D[row] += static_cast<double>(W->values[row][i]);
-      }
-      //T[ct+diag_ind][2] += D[row];
+    W->rowSums(D);
+    for(int row = 0; row < W->n; row++)
       D[row] = sqrt(D[row]);
-      ct +=  W->nz[row];
+  }
+
+  void buildSuperpixelW(const cv::Mat & input, const cv::Mat & labels,
+			int nlabels, SMatrix* &W, double* &D,
+			SuperpixelGraph & graph)
+  {
+    int dthresh = 5;
+    float sigma = 0.1;
+    int R = nlabels;
+
+    // pixels of the disc, and the pixel pairs it puts across a unit of
+    // straight boundary
+    int K = 0, cross = 0;
+    for(int u = -dthresh; u <= dthresh; u++)
+      for(int v = -dthresh; v <= dthresh; v++)
+	if(u*u + v*v <= dthresh*dthresh){
+	  K++;
+	  if(u > 0)
+	    cross += u;
+	}
+
+    vector<int> size(R, 0);
+    graph.cx.assign(R, 0.0);
+    graph.cy.assign(R, 0.0);
+    vector<long long> pairs;
+    for(int y = 0; y < labels.rows; y++)
+      for(int x = 0; x < labels.cols; x++){
+	int i = labels.at<int>(y,x) - 1;
+	size[i]++;
+	graph.cx[i] += x;
+	graph.cy[i] += y;
+	int right = (x+1 < labels.cols) ? labels.at<int>(y,x+1) - 1 : i;
+	int down = (y+1 < labels.rows) ? labels.at<int>(y+1,x) - 1 : i;
+	if(right != i)
+	  pairs.push_back((long long)std::min(i,right)*R + std::max(i,right));
+	if(down != i)
+	  pairs.push_back((long long)std::min(i,down)*R + std::max(i,down));
+      }
+    for(int i = 0; i < R; i++){
+      graph.cx[i] /= size[i];
+      graph.cy[i] /= size[i];
     }
-    delete W;
+
+    // adjacent superpixels with the length of their common boundary
+    std::sort(pairs.begin(), pairs.end());
+    vector<int> ei, ej, len;
+    for(size_t k = 0; k < pairs.size(); k++){
+      if(k > 0 && pairs[k] == pairs[k-1]){
+	len.back()++;
+	continue;
+      }
+      ei.push_back(pairs[k] / R);
+      ej.push_back(pairs[k] % R);
+      len.push_back(1);
+    }
+    int nedges = ei.size();
+
+    // intervening contour between the centroids
+    vector<float> a(nedges);
+    vector<int> degree(R, 0);
+    vector<double> boundary(R, 0.0);
+    for(int e = 0; e < nedges; e++){
+      cv::LineIterator it(input,
+			  cv::Point(cvRound(graph.cx[ei[e]]), cvRound(graph.cy[ei[e]])),
+			  cv::Point(cvRound(graph.cx[ej[e]]), cvRound(graph.cy[ej[e]])));
+      float maxpb = 0.0f;
+      for(int k = 0; k < it.count; k++, ++it)
+	maxpb = std::max(maxpb, *(const float*)*it);
+      a[e] = exp(-(1 - Group::C_IC_SS(maxpb)) / sigma);
+      degree[ei[e]]++;
+      degree[ej[e]]++;
+      boundary[ei[e]] += len[e];
+      boundary[ej[e]] += len[e];
+    }
+
+    graph.start.assign(R+1, 0);
+    for(int i = 0; i < R; i++)
+      graph.start[i+1] = graph.start[i] + degree[i];
+    graph.adj.resize(graph.start[R]);
+    graph.affinity.resize(graph.start[R]);
+    vector<int> adj_len(graph.start[R]);
+    vector<int> fill(graph.start.begin(), graph.start.end()-1);
+    for(int e = 0; e < nedges; e++){
+      int k = fill[ei[e]]++;
+      graph.adj[k] = ej[e];
+      graph.affinity[k] = a[e];
+      adj_len[k] = len[e];
+      k = fill[ej[e]]++;
+      graph.adj[k] = ei[e];
+      graph.affinity[k] = a[e];
+      adj_len[k] = len[e];
+    }
+
+    // the edges are sorted, so each neighbour list is increasing; the
+    // diagonal goes in where the neighbours pass i
+    int* row = new int[R+1];
+    int* col = new int[R + 2*nedges];
+    float* values = new float[R + 2*nedges];
+    int nnz = 0;
+    for(int i = 0; i < R; i++){
+      row[i] = nnz;
+      int k = graph.start[i];
+      for(; k < graph.start[i+1] && graph.adj[k] < i; k++){
+	col[nnz] = graph.adj[k];
+	values[nnz++] = cross * adj_len[k] * graph.affinity[k];
+      }
+      // pairs inside the superpixel: all of its discs but what reaches out
+      col[nnz] = i;
+      values[nnz++] = std::max((double)size[i], (double)K*size[i] - cross*boundary[i]);
+      for(; k < graph.start[i+1]; k++){
+	col[nnz] = graph.adj[k];
+	values[nnz++] = cross * adj_len[k] * graph.affinity[k];
+      }
+    }
+    row[R] = nnz;
+    W = new SMatrix(R, row, col, values);
+
+    D = new double[R];
+    W->rowSums(D);
+    for(int i = 0; i < R; i++)
+      D[i] = sqrt(D[i]);
   }
 }
@@ -27,11 +27,33 @@
 #include <ctype.h>
 #include <memory.h>
 
+#include <vector>
+
 #include "array.h"
 #include "ic.h"
 
 namespace Group
 {
+  void buildDualLattice(const cv::Mat& pb, DualLattice& boundaries)
+  {
+    const int width = pb.cols;
+    const int height = pb.rows;
+    boundaries.width = width;
+    boundaries.height = height;
+    boundaries.stride = height+1;
+    boundaries.HV = cv::Mat::zeros(width+1, boundaries.stride, CV_32FC2);
+    for (int y = 0; y < height; y++)
+    {
+      const float* p = pb.ptr<float>(y);
+      for (int x = 0; x < width; x++)
+      {
+        // below (x,y) is H edge (x,y+1), right of it V edge (x+1,y)
+        ((float*)boundaries.HV.data)[((size_t)x*boundaries.stride + y+1)*2] = p[x];
+        ((float*)boundaries.HV.data)[((size_t)(x+1)*boundaries.stride + y)*2 + 1] = p[x];
+      }
+    }
+  }
+
   //
   // given a pb image and window radius, computes a support map for each
   // pixel out to the given radius.
@@ -40,8 +62,14 @@ namespace Group
                        const float thresh, SupportMap& support)
   {
     support.resize(boundaries.width,boundaries.height);
+    support.arena.clear();
     Util::Array1D<PointIC> adj;
     int count = 0;
+    RayTemplate rays;
+    buildRayTemplate(boundaries,wr,rays);
+    Util::Array2D<PointIC> scanLines(2*wr+1,2*wr+1);
+    Util::Array1D<int> scanCount(2*wr+1);
+    Util::Array1D<PointIC> scratch(4*wr+2);
 
     //Util::Message::startBlock(boundaries.width,"computing support");
     //printf("computing support\n"); //TODO messages where when if any?
@@ -50,8 +78,12 @@ namespace Group
       //Util::Message::stepBlock();
       for (int y = 0; y < boundaries.height; y++)
       {
-        interveningContour(boundaries,thresh,x,y,wr,adj,count);    
-        Util::Array1D<PointIC> map(count);
+        if (!interveningContour(boundaries,rays,thresh,x,y,adj,count))
+        {
+          interveningContour(boundaries,thresh,x,y,wr,adj,count,
+                             scanLines,scanCount,scratch);
+        }
+        Util::Array1D<PointIC> map(count,support.arena);
         for (int i = 0; i < count; i++)
         {
           map(i) = adj(i);    
@@ -62,61 +94,29 @@ namespace Group
           assert(iy >= 0);
           assert(iy < boundaries.height);
         }
-        support(x,y) = map;
+        support(x,y).swap(map);
       }
     }
     //Util::Message::endBlock();
   }
 
+
   //
-  // Walk the bresenham line from (x0,y0) to (x2,y2) ignoring any points outside
-  // a circular window of radius wr. 
-  // (x1,y1) and (x3,y3) should be on either side of (x2,y2)
-  //
-  // For each line, stop if the max-accumulated pb is > thresh. 
-  //
-  // Append any points on the line (for which the line is the best approximant
-  // and distance from x0 is less than wr) to scanlines array.
-  //
-  // points is preallocated scratch space.
-  // scanCount and scanLines store the results
+  // Walk the bresenham line from (x0,y0) to (x2,y2); (x1,y1) and (x3,y3)
+  // should be on either side of (x2,y2).  Only the geometry: for every
+  // step visit(xi,yi,good,ne,lat,ex,ey) gets the point reached, whether
+  // the line is the best approximant for it, and the ne lattice edges
+  // crossed (lat 0 for H, 1 for V, at (ex,ey)).  The walk stops when
+  // visit returns false.  Returns the octant of the line.
   //
-  void
-  ic_walk (const DualLattice& boundaries, const float thresh, 
-           const int x0, const int y0, 
-           const int x1, const int y1,
-           const int x2, const int y2,
-           const int x3, const int y3,
-           const int wr,
-           Util::Array1D <PointIC> &points, 
-           Util::Array1D <int>&scanCount,
-           Util::Array2D <PointIC> &scanLines)
+  template <class Visit>
+  static int
+  ic_ray (const int x0, const int y0, 
+          const int x1, const int y1,
+          const int x2, const int y2,
+          const int x3, const int y3,
+          Visit& visit)
   {
-      const int width = boundaries.width;
-      const int height = boundaries.height;
-
-      // the predicate that uses long longs will overflow if the image
-      // is too large
-      assert (2*wr+1 < 1000);
-
-      // make sure points array is big enough
-      assert ((int) points.size () >= 4*wr+2);
-
-      // make sure scan arrays are the right size
-      assert ((int)scanCount.size() == 2*wr+1);
-      assert ((int)scanLines.size(0) == 2*wr+1);
-      assert ((int)scanLines.size(1) == 2*wr+1);
-
-      //sanity check the points
-      assert (x0 >= 0 && x0 < width);
-      assert (y0 >= 0 && y0 < height);
-      assert (x1 >= 0 && x1 < width);
-      assert (y1 >= 0 && y1 < height);
-      assert (x2 >= 0 && x2 < width);
-      assert (y2 >= 0 && y2 < height);
-      assert (x3 >= 0 && x3 < width);
-      assert (y3 >= 0 && y3 < height);
-
       // make sure points are all distinct
       assert (x0 != x1 || y0 != y1);
       assert (x0 != x2 || y0 != y2);
@@ -173,16 +173,9 @@ namespace Group
         default: assert (0);
       }
 
-      // maxpb contains the max-accumulation of pb from (x0,y0) to (x,y)
-      // on the bresenham line. 
-      float maxpb = 0.0f; 
-
       // (xi,yi) is our current location on the bresenham line
       int xi = x0;
       int yi = y0;
-
-      // accumulate the points in the order we find them
-      int count = 0;
       int oldx = xi;
       int oldy = yi;
 
@@ -256,83 +249,156 @@ namespace Group
                           || (dot11*doti2*doti2 > dot22*doti1*doti1
                               && dot33*doti2*doti2 >= dot22*doti3*doti3);
 
-
-        // otherwise accumulate the pb value if we've crossed an edge
-        float intersected = 0.0f;
+        // the lattice edges crossed by this step, H as 0 and V as 1
+        int lat[4];
+        int ex[4];
+        int ey[4];
+        int ne = 0;
         if (oldx == xi)
         {
-          if (yi > oldy)
-          {
-            intersected = boundaries.H.at<float>(xi,yi);  
-          }
-          else if (yi < oldy)
-          {
-            intersected = boundaries.H.at<float>(oldx,oldy);  
-          }
+          lat[0] = 0;
+          if (yi > oldy) { ex[0] = xi; ey[0] = yi; }
+          else { ex[0] = oldx; ey[0] = oldy; }
+          ne = 1;
         } 
         else if (oldy == yi)
         {
-          if (xi > oldx)
-          {
-            intersected = boundaries.V.at<float>(xi,yi);  
-          }
-          else if (xi < oldx)
-          {
-            intersected = boundaries.V.at<float>(oldx,oldy);  
-          }
+          lat[0] = 1;
+          if (xi > oldx) { ex[0] = xi; ey[0] = yi; }
+          else { ex[0] = oldx; ey[0] = oldy; }
+          ne = 1;
         }
         else
         {
-          if ((xi > oldx) && (yi > oldy))  //down to right
+          lat[0] = 0; lat[1] = 0; lat[2] = 1; lat[3] = 1;
+          if (yi > oldy)  //down
           {
-            intersected = std::max(boundaries.H.at<float>(oldx,yi),intersected); 
-            intersected = std::max(boundaries.H.at<float>(xi,yi),intersected); 
-            intersected = std::max(boundaries.V.at<float>(xi,oldy),intersected); 
-            intersected = std::max(boundaries.V.at<float>(xi,yi),intersected); 
+            ex[0] = oldx; ey[0] = yi;
+            ex[1] = xi;   ey[1] = yi;
           }
-          else if ((xi > oldx) && (yi < oldy)) //up to right
+          else            //up
           {
-            intersected = std::max(boundaries.H.at<float>(oldx,oldy),intersected); 
-            intersected = std::max(boundaries.H.at<float>(xi,oldy),intersected); 
-            intersected = std::max(boundaries.V.at<float>(xi,oldy),intersected); 
-            intersected = std::max(boundaries.V.at<float>(xi,yi),intersected); 
+            ex[0] = oldx; ey[0] = oldy;
+            ex[1] = xi;   ey[1] = oldy;
           }
-          else if ((xi < oldx) && (yi > oldy)) //down to left
+          if (xi > oldx)  //to right
           {
-            intersected = std::max(boundaries.H.at<float>(oldx,yi),intersected); 
-            intersected = std::max(boundaries.H.at<float>(xi,yi),intersected); 
-            intersected = std::max(boundaries.V.at<float>(oldx,oldy),intersected); 
-            intersected = std::max(boundaries.V.at<float>(oldx,yi),intersected); 
+            ex[2] = xi; ey[2] = oldy;
+            ex[3] = xi; ey[3] = yi;
           }
-          else if ((xi < oldx) && (yi < oldy)) //up to left
+          else            //to left
           {
-            intersected = std::max(boundaries.H.at<float>(oldx,oldy),intersected); 
-            intersected = std::max(boundaries.H.at<float>(xi,oldy),intersected); 
-            intersected = std::max(boundaries.V.at<float>(oldx,oldy),intersected); 
-            intersected = std::max(boundaries.V.at<float>(oldx,yi),intersected); 
+            ex[2] = oldx; ey[2] = oldy;
+            ex[3] = oldx; ey[3] = yi;
           }
+          ne = 4;
         }
-        maxpb = std::max(maxpb,intersected);
         oldx = xi;
         oldy = yi;
 
-        // if the approximation is not good, then skip this point
-        if (!good) { continue; }
-
-        // if the accumulated pb is too high, then stop
-        if (maxpb > thresh)
-        {
-          break;
-        }
+        if (!visit(xi, yi, good, ne, lat, ex, ey)) { break; }
+      }
+      return octant;
+  }
 
-        // record this connection
-        PointIC p;
-        p.x = xi;
-        p.y = yi;
-        p.sim = 1.0f - maxpb;
-        points(count) = p;
-        count++;
+  //
+  // max-accumulates pb along a ray, recording the points the line is the
+  // best approximant for until the accumulated pb is > thresh
+  //
+  struct ic_accumulate
+  {
+    const DualLattice* boundaries;
+    float thresh;
+    float maxpb;
+    Util::Array1D<PointIC>* points;
+    int count;
+
+    bool operator()(const int xi, const int yi, const bool good, const int ne,
+                    const int* lat, const int* ex, const int* ey)
+    {
+      // accumulate the pb value of the edges we've crossed
+      float intersected = 0.0f;
+      for (int e = 0; e < ne; e++)
+      {
+        intersected = std::max(boundaries->edge(lat[e],ex[e],ey[e]),intersected);
       }
+      maxpb = std::max(maxpb,intersected);
+
+      // if the approximation is not good, then skip this point
+      if (!good) { return true; }
+
+      // if the accumulated pb is too high, then stop
+      if (maxpb > thresh) { return false; }
+
+      // record this connection
+      PointIC p;
+      p.x = xi;
+      p.y = yi;
+      p.sim = 1.0f - maxpb;
+      (*points)(count) = p;
+      count++;
+      return true;
+    }
+  };
+
+  //
+  // Walk the bresenham line from (x0,y0) to (x2,y2) ignoring any points outside
+  // a circular window of radius wr. 
+  // (x1,y1) and (x3,y3) should be on either side of (x2,y2)
+  //
+  // For each line, stop if the max-accumulated pb is > thresh. 
+  //
+  // Append any points on the line (for which the line is the best approximant
+  // and distance from x0 is less than wr) to scanlines array.
+  //
+  // points is preallocated scratch space.
+  // scanCount and scanLines store the results
+  //
+  void
+  ic_walk (const DualLattice& boundaries, const float thresh, 
+           const int x0, const int y0, 
+           const int x1, const int y1,
+           const int x2, const int y2,
+           const int x3, const int y3,
+           const int wr,
+           Util::Array1D <PointIC> &points, 
+           Util::Array1D <int>&scanCount,
+           Util::Array2D <PointIC> &scanLines)
+  {
+      const int width = boundaries.width;
+      const int height = boundaries.height;
+
+      // the predicate that uses long longs will overflow if the image
+      // is too large
+      assert (2*wr+1 < 1000);
+
+      // make sure points array is big enough
+      assert ((int) points.size () >= 4*wr+2);
+
+      // make sure scan arrays are the right size
+      assert ((int)scanCount.size() == 2*wr+1);
+      assert ((int)scanLines.size(0) == 2*wr+1);
+      assert ((int)scanLines.size(1) == 2*wr+1);
+
+      //sanity check the points
+      assert (x0 >= 0 && x0 < width);
+      assert (y0 >= 0 && y0 < height);
+      assert (x1 >= 0 && x1 < width);
+      assert (y1 >= 0 && y1 < height);
+      assert (x2 >= 0 && x2 < width);
+      assert (y2 >= 0 && y2 < height);
+      assert (x3 >= 0 && x3 < width);
+      assert (y3 >= 0 && y3 < height);
+
+      // accumulate the points in the order we find them
+      ic_accumulate visit;
+      visit.boundaries = &boundaries;
+      visit.thresh = thresh;
+      visit.maxpb = 0.0f;
+      visit.points = &points;
+      visit.count = 0;
+      const int octant = ic_ray(x0,y0, x1,y1, x2,y2, x3,y3, visit);
+      const int count = visit.count;
 
       // add our list of points to scanLines; we have to reverse
       // the order in octants 2,3,4,5
@@ -365,91 +431,53 @@ namespace Group
 
 
   //
-  // given a pb image, a pixel (x0,y0), and a pb threshold, compute the intervening-contour 
-  // weight to all pixels inside a given box of radius "wr" subject to the threshold "thresh".
-  // pb is max-accumulated along bresenham lines.  the result is stored in scanline order as
-  // a list of points and their pb value.
+  // the rays interveningContour walks from (x0,y0) to the boundary of the
+  // rectangle [rxa,rxb]x[rya,ryb]: walk(x1,y1,x2,y2,x3,y3) for every ray
+  // and walk.corner(x,y) for the corners next to (x0,y0), which no ray
+  // reaches.
   //
-  void interveningContour(const DualLattice& boundaries, const float thresh,
-                          const int x0, const int y0, const int wr,
-                          Util::Array1D<PointIC> &adj, int &count)
+  template <class Walk>
+  static void
+  ic_box (const int x0, const int y0, const int rxa, const int rya,
+          const int rxb, const int ryb, Walk& walk)
   {
-      const int width = boundaries.width;
-      const int height = boundaries.height;
-
-      // make sure (x0,y0) is valid
-      assert (x0 >= 0 && x0 < width);
-      assert (y0 >= 0 && y0 < height);
-
-      // make sure adj array is big enough
-      adj.resize((2*wr+1)*(2*wr+1));
-
-      // allocate space for lists of pixels; this operation is O(1)
-      // since the space need not be initialized.
-      Util::Array2D <PointIC>scanLines(2*wr+1,2*wr+1);
-
-      // we need to keep track of the length of the scan lines
-      Util::Array1D <int>scanCount(2*wr+1);
-      scanCount.init(0);
-
-      // scratch space for ic_walk() function
-      Util::Array1D<PointIC> scratch(4*wr+2);
-
-      // the rectangle of interest, a square with edge of length
-      // 2*wr+1 clipped to the image dimensions
-      const int rxa = std::max(0,x0-wr);
-      const int rya = std::max(0,y0-wr);
-      const int rxb = std::min(x0+wr,width-1);
-      const int ryb = std::min(y0+wr,height-1);
-
-      // walk around the boundary, collecting points in the scanline array
       // first walk around the rectangle boundary clockwise for theta = [pi,0]
       if (x0 > rxa) // left 
       {
         if ((y0 > 0) && (y0 < ryb))
         {
-          ic_walk(boundaries, thresh, x0,y0, rxa,y0-1, rxa,y0, rxa,y0+1, wr, scratch,scanCount,scanLines);
+          walk(rxa,y0-1, rxa,y0, rxa,y0+1);
         }
         for (int y = y0-1; y > rya; y--)
         {
-          ic_walk(boundaries, thresh, x0,y0, rxa,y-1, rxa,y, rxa,y+1, wr, scratch,scanCount,scanLines);
+          walk(rxa,y-1, rxa,y, rxa,y+1);
         }
       }
 
       if (x0 > rxa+1 || y0 > rya+1 || ((x0 > rxa) && (y0 > rya)) ) // top-left
       {
-        ic_walk(boundaries, thresh, x0,y0, rxa,rya+1, rxa,rya, rxa+1,rya, wr, scratch, scanCount, scanLines);
+        walk(rxa,rya+1, rxa,rya, rxa+1,rya);
       }
       if ( ((x0 == rxa) && (y0 == rya+1)) || ((x0 == rxa+1) && (y0 == rya)) )
       {
-        PointIC pnt;
-        pnt.x = rxa;
-        pnt.y = rya;
-        pnt.sim = 1.0f;
-        const int yind = pnt.y - y0 + wr;
-        scanLines(yind,scanCount(yind)++) = pnt;
+        walk.corner(rxa,rya);
       }
 
       if (y0 > rya) // top
       {
         for (int x = rxa+1; x < rxb; x++)
         {
-          ic_walk(boundaries, thresh, x0,y0, x-1,rya, x,rya, x+1,rya, wr, scratch, scanCount, scanLines);
+          walk(x-1,rya, x,rya, x+1,rya);
         }
       }
 
       if ((y0 > rya+1) || (x0 < rxb-1) || ((y0 > rya) && (x0 < rxb)) ) // top-right
       {
-        ic_walk(boundaries, thresh, x0,y0, rxb-1,rya, rxb,rya, rxb,rya+1, wr, scratch, scanCount, scanLines);
+        walk(rxb-1,rya, rxb,rya, rxb,rya+1);
       }
       if ( ((x0 == rxb-1) && (y0 == rya)) || ((x0 == rxb) && (y0 == rya+1)) )
       {
-        PointIC pnt;
-        pnt.x = rxb;
-        pnt.y = rya;
-        pnt.sim = 1.0f;
-        const int yind = pnt.y - y0 + wr;
-        scanLines(yind,scanCount(yind)++) = pnt;
+        walk.corner(rxb,rya);
       }
 
 
@@ -457,7 +485,7 @@ namespace Group
       {
         for (int y = rya+1; y < y0; y++)
         {
-          ic_walk(boundaries, thresh, x0,y0, rxb,y-1, rxb,y, rxb,y+1, wr, scratch, scanCount, scanLines);
+          walk(rxb,y-1, rxb,y, rxb,y+1);
         }
       }
 
@@ -466,57 +494,301 @@ namespace Group
       {
         for (int y = y0+1; y < ryb; y++)
         {
-          ic_walk(boundaries, thresh, x0,y0, rxa,y-1, rxa,y, rxa,y+1, wr, scratch, scanCount, scanLines);
+          walk(rxa,y-1, rxa,y, rxa,y+1);
         }
       }
 
       if ((x0 > rxa+1) || (y0 < ryb-1) || ((x0 > rxa) && (y0 < ryb))) // bottom-left
       {
-        ic_walk(boundaries, thresh, x0,y0, rxa,ryb-1, rxa,ryb, rxa+1,ryb, wr, scratch, scanCount, scanLines);
+        walk(rxa,ryb-1, rxa,ryb, rxa+1,ryb);
       }
       if ( ((x0 == rxa) && (y0 == ryb-1)) || ((x0 == rxa+1) && (y0 == ryb)) )
       {
-        PointIC pnt;
-        pnt.x = rxa;
-        pnt.y = ryb;
-        pnt.sim = 1.0f;
-        const int yind = pnt.y - y0 + wr;
-        scanLines(yind,scanCount(yind)++) = pnt;
+        walk.corner(rxa,ryb);
       }
       if (y0 < ryb) // bottom
       {
         for (int x = rxa+1; x < rxb; x++)
         {
-          ic_walk(boundaries, thresh, x0,y0, x-1,ryb, x,ryb, x+1,ryb, wr, scratch, scanCount, scanLines);
+          walk(x-1,ryb, x,ryb, x+1,ryb);
         }
       }
 
       if ((y0 < ryb-1) || (x0 < rxb-1) || ((y0 < ryb) && (x0 < rxb))) // bottom-right
       {
-        ic_walk(boundaries, thresh, x0,y0, rxb-1,ryb, rxb,ryb, rxb,ryb-1, wr, scratch, scanCount, scanLines);
+        walk(rxb-1,ryb, rxb,ryb, rxb,ryb-1);
       }
       if ( ((x0 == rxb-1) && (y0 == ryb)) || ((x0 == rxb) && (y0 == ryb-1)) )
       {
-        PointIC pnt;
-        pnt.x = rxb;
-        pnt.y = ryb;
-        pnt.sim = 1.0f;
-        const int yind = pnt.y - y0 + wr;
-        scanLines(yind,scanCount(yind)++) = pnt;
+        walk.corner(rxb,ryb);
       }
 
       if (x0 < rxb) // right
       {
         for (int y = ryb-1; y > y0; y--)
         {
-          ic_walk(boundaries, thresh, x0,y0, rxb,y-1, rxb,y, rxb,y+1, wr, scratch, scanCount, scanLines);
+          walk(rxb,y-1, rxb,y, rxb,y+1);
         }
         if ((y0 > 0) && (y0 < ryb))
         {
-          ic_walk(boundaries, thresh, x0,y0, rxb,y0-1, rxb,y0, rxb,y0+1, wr, scratch, scanCount, scanLines);
+          walk(rxb,y0-1, rxb,y0, rxb,y0+1);
+        }
+      }
+  }
+
+  //
+  // max-accumulates pb over every step of a ray
+  //
+  struct ic_max
+  {
+    const DualLattice* boundaries;
+    float maxpb;
+
+    bool operator()(const int /*xi*/, const int /*yi*/, const bool /*good*/,
+                    const int ne, const int* lat, const int* ex, const int* ey)
+    {
+      for (int e = 0; e < ne; e++)
+      {
+        maxpb = std::max(boundaries->edge(lat[e],ex[e],ey[e]),maxpb);
+      }
+      return true;
+    }
+  };
+
+  //
+  // walks every ray of the box with ic_walk into the scanline arrays
+  //
+  struct ic_scan
+  {
+    const DualLattice* boundaries;
+    float thresh;
+    int x0, y0, wr;
+    Util::Array1D<PointIC>* scratch;
+    Util::Array1D<int>* scanCount;
+    Util::Array2D<PointIC>* scanLines;
+
+    void operator()(const int x1, const int y1, const int x2, const int y2,
+                    const int x3, const int y3)
+    {
+      ic_walk(*boundaries, thresh, x0,y0, x1,y1, x2,y2, x3,y3, wr,
+              *scratch, *scanCount, *scanLines);
+    }
+
+    void corner(const int x, const int y)
+    {
+      PointIC pnt;
+      pnt.x = x;
+      pnt.y = y;
+      pnt.sim = 1.0f;
+      const int yind = pnt.y - y0 + wr;
+      (*scanLines)(yind,(*scanCount)(yind)++) = pnt;
+    }
+  };
+
+  //
+  // appends the steps of one ray to a RayTemplate, offsets relative to
+  // (x0,y0); slot holds the scanline key of the point for now
+  //
+  struct ic_record
+  {
+    int x0, y0, wr;
+    RayTemplate* rays;
+
+    bool operator()(const int xi, const int yi, const bool good, const int ne,
+                    const int* lat, const int* ex, const int* ey)
+    {
+      for (int e = 0; e < 4; e++)
+      {
+        const int i = (e < ne) ? e : 0;
+        rays->offset.push_back(((ex[i]-x0)*rays->stride + (ey[i]-y0))*2 + lat[i]);
+      }
+      rays->slot.push_back(good ? (yi-y0+wr)*(2*wr+1) + (xi-x0+wr) : -1);
+      return true;
+    }
+
+    void operator()(const int x1, const int y1, const int x2, const int y2,
+                    const int x3, const int y3)
+    {
+      ic_ray(x0,y0, x1,y1, x2,y2, x3,y3, *this);
+
+      // drop the steps past the last recorded point
+      int end = rays->slot.size();
+      while (end > rays->ray.back() && rays->slot[end-1] < 0) { end--; }
+      rays->slot.resize(end);
+      rays->offset.resize(4*end);
+      if (end > rays->ray.back()) { rays->ray.push_back(end); }
+    }
+
+    void corner(const int /*x*/, const int /*y*/)
+    {
+      // only reached from pixels next to a clipped corner
+      assert (0);
+    }
+  };
+
+  //
+  // lay out the rays of a pixel whose box of radius wr is not clipped
+  //
+  void buildRayTemplate(const DualLattice& boundaries, const int wr, RayTemplate& rays)
+  {
+    const int side = 2*wr+1;
+    rays.wr = wr;
+    rays.stride = boundaries.stride;
+    rays.ray.assign(1, 0);
+    rays.offset.clear();
+    rays.slot.clear();
+
+    ic_record walk;
+    walk.x0 = wr;
+    walk.y0 = wr;
+    walk.wr = wr;
+    walk.rays = &rays;
+    ic_box(wr, wr, 0, 0, 2*wr, 2*wr, walk);
+
+    // number the recorded points in scanline order
+    std::vector<int> slotOf(side*side, -1);
+    for (size_t s = 0; s < rays.slot.size(); s++)
+    {
+      if (rays.slot[s] < 0) { continue; }
+      assert (slotOf[rays.slot[s]] == -1);
+      slotOf[rays.slot[s]] = 0;
+    }
+    rays.dx.clear();
+    rays.dy.clear();
+    for (int key = 0; key < side*side; key++)
+    {
+      if (slotOf[key] < 0) { continue; }
+      slotOf[key] = rays.dx.size();
+      rays.dx.push_back(key%side - wr);
+      rays.dy.push_back(key/side - wr);
+    }
+    for (size_t s = 0; s < rays.slot.size(); s++)
+    {
+      if (rays.slot[s] >= 0) { rays.slot[s] = slotOf[rays.slot[s]]; }
+    }
+  }
+
+  //
+  // the same points and values as the box walk of interveningContour for
+  // an unclipped box
+  //
+  bool interveningContour(const DualLattice& boundaries, const RayTemplate& rays,
+                          const float thresh, const int x0, const int y0,
+                          Util::Array1D<PointIC> &adj, int &count)
+  {
+      const int wr = rays.wr;
+      if (x0 < wr || y0 < wr || 
+          x0+wr >= boundaries.width || y0+wr >= boundaries.height)
+      {
+        return false;
+      }
+      assert (rays.stride == boundaries.stride);
+
+      adj.resize((2*wr+1)*(2*wr+1));
+      PointIC* out = adj.data();
+
+      // the lattice seen from (x0,y0)
+      const float* lattice = boundaries.edges(x0,y0);
+
+      // max-accumulate along each ray, leaving the raw max in the slots
+      const int* off = &rays.offset[0];
+      const int nrays = rays.ray.size() - 1;
+      for (int r = 0; r < nrays; r++)
+      {
+        float maxpb = 0.0f;
+        for (int s = rays.ray[r]; s < rays.ray[r+1]; s++)
+        {
+          const int* o = off + 4*s;
+          const float intersected = 
+            std::max(std::max(lattice[o[0]], lattice[o[1]]),
+                     std::max(lattice[o[2]], lattice[o[3]]));
+          maxpb = std::max(maxpb,intersected);
+          if (rays.slot[s] >= 0) { out[rays.slot[s]].sim = maxpb; }
         }
       }
 
+      // keep the points reached before the accumulated pb went over thresh
+      count = 0;
+      const int nslots = rays.dx.size();
+      for (int i = 0; i < nslots; i++)
+      {
+        const float maxpb = out[i].sim;
+        if (maxpb > thresh) { continue; }
+        out[count].x = x0 + rays.dx[i];
+        out[count].y = y0 + rays.dy[i];
+        out[count].sim = 1.0f - maxpb;
+        count++;
+      }
+      return true;
+  }
+
+  //
+  // given a pb image, a pixel (x0,y0), and a pb threshold, compute the intervening-contour 
+  // weight to all pixels inside a given box of radius "wr" subject to the threshold "thresh".
+  // pb is max-accumulated along bresenham lines.  the result is stored in scanline order as
+  // a list of points and their pb value.
+  //
+  void interveningContour(const DualLattice& boundaries, const float thresh,
+                          const int x0, const int y0, const int wr,
+                          Util::Array1D<PointIC> &adj, int &count)
+  {
+      // allocate space for lists of pixels; this operation is O(1)
+      // since the space need not be initialized.
+      Util::Array2D <PointIC>scanLines(2*wr+1,2*wr+1);
+
+      // we need to keep track of the length of the scan lines
+      Util::Array1D <int>scanCount(2*wr+1);
+
+      // scratch space for ic_walk() function
+      Util::Array1D<PointIC> scratch(4*wr+2);
+
+      interveningContour(boundaries,thresh,x0,y0,wr,adj,count,
+                         scanLines,scanCount,scratch);
+  }
+
+  //
+  // the same with caller-owned scratch space, so that a loop over pixels
+  // allocates nothing once the arrays have their size.
+  //
+  void interveningContour(const DualLattice& boundaries, const float thresh,
+                          const int x0, const int y0, const int wr,
+                          Util::Array1D<PointIC> &adj, int &count,
+                          Util::Array2D<PointIC> &scanLines,
+                          Util::Array1D<int> &scanCount,
+                          Util::Array1D<PointIC> &scratch)
+  {
+      const int width = boundaries.width;
+      const int height = boundaries.height;
+
+      // make sure (x0,y0) is valid
+      assert (x0 >= 0 && x0 < width);
+      assert (y0 >= 0 && y0 < height);
+
+      // make sure the arrays are big enough; a no-op once they are
+      adj.resize((2*wr+1)*(2*wr+1));
+      scanLines.resize(2*wr+1,2*wr+1);
+      scanCount.resize(2*wr+1);
+      scratch.resize(4*wr+2);
+      scanCount.init(0);
+
+      // the rectangle of interest, a square with edge of length
+      // 2*wr+1 clipped to the image dimensions
+      const int rxa = std::max(0,x0-wr);
+      const int rya = std::max(0,y0-wr);
+      const int rxb = std::min(x0+wr,width-1);
+      const int ryb = std::min(y0+wr,height-1);
+
+      // walk around the boundary, collecting points in the scanline array
+      ic_scan walk;
+      walk.boundaries = &boundaries;
+      walk.thresh = thresh;
+      walk.x0 = x0;
+      walk.y0 = y0;
+      walk.wr = wr;
+      walk.scratch = &scratch;
+      walk.scanCount = &scanCount;
+      walk.scanLines = &scanLines;
+      ic_box(x0, y0, rxa, rya, rxb, ryb, walk);
 
       for (int y = 0; y < 2*wr+1; y++)
       {
@@ -553,5 +825,25 @@ namespace Group
       }
   }
 
+  //
+  // compute (1 - max over lattice energies on a straightline path connecting p1 and p2)
+  //
+  void interveningContour (const DualLattice& boundaries, const int x1, const int y1, 
+                           const int x2, const int y2, float& icsim)
+  {
+      icsim = 1.0f;
+      if (x1 == x2 && y1 == y2) { return; }
+
+      // the neighbours of (x2,y2) only steer the best-approximant test,
+      // which does not matter here; any two distinct points off the line do
+      const int dx = x2 - x1;
+      const int dy = y2 - y1;
+      ic_max visit;
+      visit.boundaries = &boundaries;
+      visit.maxpb = 0.0f;
+      ic_ray(x1,y1, x2+2*dx+1,y2+2*dy, x2,y2, x2+2*dx,y2+2*dy+1, visit);
+      icsim = 1.0f - visit.maxpb;
+  }
+
 } //namespace Group
 //std::cerr << "(" << rxa << "," << rya << ")-(" << rxb << "," << ryb << ")" << std::endl;
@@ -0,0 +1,866 @@
+//
+//    Block eigensolver (LOBPCG) for the smallest eigenpairs of a
+//    symmetric LinearOperator, and the preconditioners it can use.
+//
+//    The search space S = [X P W] is kept as one column-major block
+//    (vector i at S + i*n) together with AS = A*S, and is orthonormal,
+//    so every Rayleigh-Ritz step is a small standard eigenproblem.
+//
+
+#include <iostream>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <opencv/cv.h>
+#include "lobpcg.h"
+
+using namespace std;
+
+namespace
+{
+  // rows handled by one parallel work item in the block kernels; a chunk
+  // of the whole search space should stay in L2
+  const int ROW_CHUNK = 1024;
+
+  // extra block vectors iterated along with the wanted ones
+  const int GUARD_VECTORS = 4;
+
+  // multigrid settings
+  const int MG_MAX_LEVELS = 10;
+  const int MG_COARSEST = 1000;
+  const int MG_COARSE_SWEEPS = 20;
+  const double MG_OMEGA = 2.0/3.0;
+
+  // element type of the search space.  products and Gram sums are always
+  // formed in double; dependent() is the relative Gram eigenvalue below
+  // which _svqb drops a direction.
+  template <typename Real>
+  struct Storage
+  {
+    static double dependent() {return 1e-12;}
+  };
+
+  template <>
+  struct Storage<float>
+  {
+    static double dependent() {return 1e-9;}
+  };
+
+  // y = A x, and x = T x, through double buffers when Real is float
+  template <typename Real>
+  void _mult(const LinearOperator& A, const Real* x, Real* y, double* buf)
+  {
+    std::copy(x, x+A.n, buf);
+    A.mult(buf, buf+A.n);
+    std::copy(buf+A.n, buf+2*A.n, y);
+  }
+
+  template <>
+  void _mult<double>(const LinearOperator& A, const double* x, double* y, double*)
+  {
+    A.mult(x, y);
+  }
+
+  template <typename Real>
+  void _precondition(const Preconditioner& T, Real* x, int n, double* buf)
+  {
+    std::copy(x, x+n, buf);
+    T.apply(buf, buf+n);
+    std::copy(buf+n, buf+2*n, x);
+  }
+
+  template <>
+  void _precondition<double>(const Preconditioner& T, double* x, int n, double* buf)
+  {
+    T.apply(x, buf);
+    memcpy(x, buf, sizeof(double)*n);
+  }
+
+  // G(i,l) = A_i . B_l over one range of rows per chunk
+  template <typename Real>
+  struct parallelInvoker_gram
+  {
+    const Real* A;
+    int ka;
+    const Real* B;
+    int kb;
+    int n;
+    bool symmetric;
+    double* partial;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      for (int c = range.begin(); c < range.end(); c++)
+      {
+        int j0 = c*ROW_CHUNK;
+        int j1 = std::min(n, j0+ROW_CHUNK);
+        double* G = partial + (size_t)c*ka*kb;
+        for (int i = 0; i < ka; i++)
+        {
+          const Real* a = A + (size_t)i*n;
+          int l = symmetric ? i : 0;
+          // four columns of B per pass over a
+          for (; l+3 < kb; l += 4)
+          {
+            const Real* b0 = B + (size_t)l*n;
+            const Real* b1 = b0 + n;
+            const Real* b2 = b1 + n;
+            const Real* b3 = b2 + n;
+            double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+            for (int j = j0; j < j1; j++)
+            {
+              s0 += a[j]*b0[j];
+              s1 += a[j]*b1[j];
+              s2 += a[j]*b2[j];
+              s3 += a[j]*b3[j];
+            }
+            G[i*kb+l] = s0;
+            G[i*kb+l+1] = s1;
+            G[i*kb+l+2] = s2;
+            G[i*kb+l+3] = s3;
+          }
+          for (; l < kb; l++)
+          {
+            const Real* b = B + (size_t)l*n;
+            double s = 0.0;
+            for (int j = j0; j < j1; j++)
+            {
+              s += a[j]*b[j];
+            }
+            G[i*kb+l] = s;
+          }
+        }
+      }
+    }
+  };
+
+  // G = A^T B, summed over chunks in a fixed order.  when symmetric
+  // only the upper triangle is computed and G is returned symmetrized.
+  template <typename Real>
+  void _gram(const Real* A, int ka, const Real* B, int kb, int n, double* G,
+             bool symmetric = false)
+  {
+    int nchunks = (n+ROW_CHUNK-1)/ROW_CHUNK;
+    vector<double> partial((size_t)nchunks*ka*kb);
+    parallelInvoker_gram<Real> parallel;
+    parallel.A = A;
+    parallel.ka = ka;
+    parallel.B = B;
+    parallel.kb = kb;
+    parallel.n = n;
+    parallel.symmetric = symmetric;
+    parallel.partial = &partial[0];
+    cv::parallel_for(cv::BlockedRange(0, nchunks), parallel);
+
+    for (int i = 0; i < ka*kb; i++)
+    {
+      G[i] = 0.0;
+    }
+    for (int c = 0; c < nchunks; c++)
+    {
+      for (int i = 0; i < ka; i++)
+      {
+        for (int l = symmetric ? i : 0; l < kb; l++)
+        {
+          G[i*kb+l] += partial[(size_t)c*ka*kb+i*kb+l];
+        }
+      }
+    }
+    if (symmetric)
+    {
+      for (int i = 0; i < ka; i++)
+      {
+        for (int l = 0; l < i; l++)
+        {
+          G[i*kb+l] = G[l*kb+i];
+        }
+      }
+    }
+  }
+
+  // V(:,out+i) = V(:,0..k) M(:,i), and the same for a second optional
+  // matrix, all from the old rows of V so it can run in place
+  template <typename Real>
+  struct parallelInvoker_transform
+  {
+    Real* V;
+    int n;
+    int k;
+    const double* M;
+    int m;
+    int out;
+    const double* M2;
+    int m2;
+    int out2;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      vector<double> row(k), res(m), res2(m2);
+      for (int c = range.begin(); c < range.end(); c++)
+      {
+        int j1 = std::min(n, (c+1)*ROW_CHUNK);
+        for (int j = c*ROW_CHUNK; j < j1; j++)
+        {
+          for (int i = 0; i < k; i++)
+          {
+            row[i] = V[(size_t)i*n+j];
+          }
+          for (int l = 0; l < m; l++)
+          {
+            double s = 0.0;
+            for (int i = 0; i < k; i++)
+            {
+              s += row[i]*M[i*m+l];
+            }
+            res[l] = s;
+          }
+          for (int l = 0; l < m2; l++)
+          {
+            double s = 0.0;
+            for (int i = 0; i < k; i++)
+            {
+              s += row[i]*M2[i*m2+l];
+            }
+            res2[l] = s;
+          }
+          for (int l = 0; l < m; l++)
+          {
+            V[(size_t)(out+l)*n+j] = res[l];
+          }
+          for (int l = 0; l < m2; l++)
+          {
+            V[(size_t)(out2+l)*n+j] = res2[l];
+          }
+        }
+      }
+    }
+  };
+
+  template <typename Real>
+  void _transform(Real* V, int n, int k, const double* M, int m, int out,
+                  const double* M2 = NULL, int m2 = 0, int out2 = 0)
+  {
+    parallelInvoker_transform<Real> parallel;
+    parallel.V = V;
+    parallel.n = n;
+    parallel.k = k;
+    parallel.M = M;
+    parallel.m = m;
+    parallel.out = out;
+    parallel.M2 = M2;
+    parallel.m2 = m2;
+    parallel.out2 = out2;
+    cv::parallel_for(cv::BlockedRange(0, (n+ROW_CHUNK-1)/ROW_CHUNK), parallel);
+  }
+
+  // V -= Q C, with Q n x kq and C kq x kv
+  template <typename Real>
+  struct parallelInvoker_project
+  {
+    Real* V;
+    int kv;
+    const Real* Q;
+    int kq;
+    const double* C;
+    int n;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      for (int c = range.begin(); c < range.end(); c++)
+      {
+        int j1 = std::min(n, (c+1)*ROW_CHUNK);
+        for (int j = c*ROW_CHUNK; j < j1; j++)
+        {
+          for (int l = 0; l < kv; l++)
+          {
+            double s = 0.0;
+            for (int i = 0; i < kq; i++)
+            {
+              s += Q[(size_t)i*n+j]*C[i*kv+l];
+            }
+            V[(size_t)l*n+j] -= s;
+          }
+        }
+      }
+    }
+  };
+
+  template <typename Real>
+  void _project(Real* V, int kv, const Real* Q, int kq, const double* C, int n)
+  {
+    parallelInvoker_project<Real> parallel;
+    parallel.V = V;
+    parallel.kv = kv;
+    parallel.Q = Q;
+    parallel.kq = kq;
+    parallel.C = C;
+    parallel.n = n;
+    cv::parallel_for(cv::BlockedRange(0, (n+ROW_CHUNK-1)/ROW_CHUNK), parallel);
+  }
+
+  // cyclic Jacobi on the symmetric k x k matrix H (destroyed).  evals
+  // ascending, evecs(:,i) = evecs[i+k*row] is the i-th eigenvector.
+  void _sym_Eigen(double* H, int k, double* evals, double* evecs)
+  {
+    vector<double> V(k*k, 0.0);
+    for (int i = 0; i < k; i++)
+    {
+      V[i*k+i] = 1.0;
+    }
+    for (int sweep = 0; sweep < 100; sweep++)
+    {
+      double off = 0.0, norm = 0.0;
+      for (int i = 0; i < k; i++)
+      {
+        for (int l = 0; l < k; l++)
+        {
+          norm += H[i*k+l]*H[i*k+l];
+          if (i != l) {off += H[i*k+l]*H[i*k+l];}
+        }
+      }
+      if (off <= 1e-24*norm) {break;}
+
+      for (int p = 0; p < k; p++)
+      {
+        for (int q = p+1; q < k; q++)
+        {
+          double hpq = H[p*k+q];
+          if (fabs(hpq) < 1e-300) {continue;}
+          double theta = (H[q*k+q]-H[p*k+p])/(2.0*hpq);
+          double t = (theta >= 0 ? 1.0 : -1.0)/(fabs(theta)+sqrt(theta*theta+1.0));
+          double c = 1.0/sqrt(t*t+1.0);
+          double s = t*c;
+          for (int i = 0; i < k; i++)
+          {
+            double hip = H[i*k+p], hiq = H[i*k+q];
+            H[i*k+p] = c*hip - s*hiq;
+            H[i*k+q] = s*hip + c*hiq;
+          }
+          for (int i = 0; i < k; i++)
+          {
+            double hpi = H[p*k+i], hqi = H[q*k+i];
+            H[p*k+i] = c*hpi - s*hqi;
+            H[q*k+i] = s*hpi + c*hqi;
+          }
+          for (int i = 0; i < k; i++)
+          {
+            double vip = V[i*k+p], viq = V[i*k+q];
+            V[i*k+p] = c*vip - s*viq;
+            V[i*k+q] = s*vip + c*viq;
+          }
+        }
+      }
+    }
+
+    vector<pair<double,int> > order(k);
+    for (int i = 0; i < k; i++)
+    {
+      order[i] = make_pair(H[i*k+i], i);
+    }
+    sort(order.begin(), order.end());
+    for (int i = 0; i < k; i++)
+    {
+      evals[i] = order[i].first;
+      for (int row = 0; row < k; row++)
+      {
+        evecs[row*k+i] = V[row*k+order[i].second];
+      }
+    }
+  }
+
+  // orthonormalizes the k columns of V (and applies the same map to AV
+  // when given) through the eigendecomposition of V^T V, dropping
+  // directions that are numerically dependent.  returns the new count.
+  template <typename Real>
+  int _svqb(Real* V, Real* AV, int k, int n)
+  {
+    if (k == 0) {return 0;}
+    vector<double> G(k*k), evals(k), evecs(k*k);
+    _gram(V, k, V, k, n, &G[0], true);
+    _sym_Eigen(&G[0], k, &evals[0], &evecs[0]);
+
+    double top = std::max(evals[k-1], 0.0);
+    int first = 0;
+    while (first < k && evals[first] <= Storage<Real>::dependent()*top) {first++;}
+    int kept = k-first;
+    if (kept == 0) {return 0;}
+
+    vector<double> M(k*kept);
+    for (int row = 0; row < k; row++)
+    {
+      for (int i = 0; i < kept; i++)
+      {
+        M[row*kept+i] = evecs[row*k+first+i]/sqrt(evals[first+i]);
+      }
+    }
+    _transform(V, n, k, &M[0], kept, 0);
+    if (AV) {_transform(AV, n, k, &M[0], kept, 0);}
+    return kept;
+  }
+
+  // V, AV -= Q (Q^T V), AQ (Q^T V) for orthonormal Q
+  template <typename Real>
+  void _orthogonalize(Real* V, Real* AV, int kv, const Real* Q,
+                      const Real* AQ, int kq, int n)
+  {
+    if (kv == 0 || kq == 0) {return;}
+    vector<double> C(kq*kv);
+    _gram(Q, kq, V, kv, n, &C[0]);
+    _project(V, kv, Q, kq, &C[0], n);
+    if (AV) {_project(AV, kv, AQ, kq, &C[0], n);}
+  }
+
+  // fills columns k..bs-1 of X, whose first k are orthonormal, with
+  // random directions orthonormal to the rest, and their products into AX,
+  // after _svqb dropped some.  returns the number of products.
+  template <typename Real>
+  int _refill(const LinearOperator& A, Real* X, Real* AX, int k, int bs,
+              int n, cv::RNG& rng, double* buf)
+  {
+    int nprod = 0;
+    while (k < bs)
+    {
+      Real* V = X + (size_t)k*n;
+      int m = bs-k;
+      for (size_t i = 0; i < (size_t)m*n; i++)
+      {
+        V[i] = rng.uniform(-1.0, 1.0);
+      }
+      for (int pass = 0; pass < 2; pass++)
+      {
+        _orthogonalize<Real>(V, NULL, m, X, NULL, k, n);
+        m = _svqb<Real>(V, NULL, m, n);
+      }
+      for (int i = 0; i < m; i++)
+      {
+        _mult(A, V+(size_t)i*n, AX+(size_t)(k+i)*n, buf);
+        nprod++;
+      }
+      k += m;
+    }
+    return nprod;
+  }
+
+  // block size for nev wanted pairs of an order n operator: a few guard
+  // vectors while the search space [X P W] fits in n, never fewer than nev
+  int _block_Size(int nev, int n)
+  {
+    return std::min(n, std::max(nev, std::min(nev + GUARD_VECTORS, n/3)));
+  }
+
+  void _diagonal(const LinearOperator& A, double* d)
+  {
+    int maxe = A.maxRowEntries();
+    vector<int> cols(std::max(maxe,1));
+    vector<float> vals(std::max(maxe,1));
+    for (int r = 0; r < A.n; r++)
+    {
+      d[r] = 0.0;
+      int count = A.storedRow(r, &cols[0], &vals[0]);
+      for (int e = 0; e < count; e++)
+      {
+        if (cols[e] == r) {d[r] += vals[e];}
+      }
+    }
+  }
+
+  // P^T (A + shift I) P for the 2x2 block aggregation of a width x height
+  // grid, as a stencil on the (width+1)/2 x (height+1)/2 grid
+  StencilMatrix* _coarsen(const LinearOperator& A, int width, int height, double shift)
+  {
+    int cw = (width+1)/2;
+    int ch = (height+1)/2;
+    int maxe = A.maxRowEntries();
+    vector<int> cols(std::max(maxe,1));
+    vector<float> vals(std::max(maxe,1));
+
+    // radius of the coarse stencil
+    int R2 = 0;
+    for (int r = 0; r < A.n; r++)
+    {
+      int X = (r%width)/2, Y = (r/width)/2;
+      int count = A.storedRow(r, &cols[0], &vals[0]);
+      for (int e = 0; e < count; e++)
+      {
+        int dx = (cols[e]%width)/2 - X;
+        int dy = (cols[e]/width)/2 - Y;
+        R2 = std::max(R2, dx*dx+dy*dy);
+      }
+    }
+    StencilMatrix* S = new StencilMatrix(cw, ch, sqrt((float)R2)+1e-3f);
+
+    int Ri = (int)ceil(sqrt((float)R2)+1e-3f);
+    int wd = 2*Ri+1;
+    vector<int> lut(wd*wd, -1);
+    for (int k = 0; k < S->K; k++)
+    {
+      lut[(S->du[k]+Ri)*wd + S->dv[k]+Ri] = k;
+    }
+
+    bool half = A.halfStored();
+    for (int r = 0; r < A.n; r++)
+    {
+      int X = (r%width)/2, Y = (r/width)/2;
+      int I = Y*cw + X;
+      int count = A.storedRow(r, &cols[0], &vals[0]);
+      for (int e = 0; e < count; e++)
+      {
+        int XX = (cols[e]%width)/2, YY = (cols[e]/width)/2;
+        int dx = XX-X, dy = YY-Y;
+        float v = vals[e];
+        if (cols[e] == r) {v += (float)shift;}
+        S->weights[(size_t)lut[(dy+Ri)*wd+dx+Ri]*S->n + I] += v;
+        if (half && cols[e] != r)
+        {
+          int J = YY*cw + XX;
+          S->weights[(size_t)lut[(-dy+Ri)*wd-dx+Ri]*S->n + J] += v;
+        }
+      }
+    }
+    return S;
+  }
+}
+
+JacobiPreconditioner::JacobiPreconditioner (const LinearOperator& A, double shift)
+{
+  n = A.n;
+  invdiag = new double[n];
+  _diagonal(A, invdiag);
+  for (int i = 0; i < n; i++)
+  {
+    invdiag[i] = 1.0/(invdiag[i]+shift);
+  }
+}
+
+JacobiPreconditioner::~JacobiPreconditioner ()
+{
+  delete[] invdiag;
+}
+
+void JacobiPreconditioner::apply(const double* in, double* out) const
+{
+  for (int i = 0; i < n; i++)
+  {
+    out[i] = invdiag[i]*in[i];
+  }
+}
+
+MultigridPreconditioner::MultigridPreconditioner (const LinearOperator& A, int width,
+                                                  int height, double shift)
+{
+  level = new Level[MG_MAX_LEVELS];
+  nlevels = 0;
+  const LinearOperator* op = &A;
+  while (true)
+  {
+    Level& L = level[nlevels];
+    L.A = op;
+    L.shift = (nlevels == 0) ? shift : 0.0;
+    L.width = width;
+    L.height = height;
+    L.invdiag = new double[op->n];
+    _diagonal(*op, L.invdiag);
+    for (int i = 0; i < op->n; i++)
+    {
+      L.invdiag[i] = 1.0/(L.invdiag[i]+L.shift);
+    }
+    L.b = (nlevels == 0) ? NULL : new double[op->n];
+    L.x = (nlevels == 0) ? NULL : new double[op->n];
+    L.r = new double[op->n];
+    nlevels++;
+
+    if (nlevels == MG_MAX_LEVELS || op->n <= MG_COARSEST || width < 2 || height < 2) {break;}
+    op = _coarsen(*op, width, height, L.shift);
+    width = (width+1)/2;
+    height = (height+1)/2;
+  }
+}
+
+MultigridPreconditioner::~MultigridPreconditioner ()
+{
+  for (int l = 0; l < nlevels; l++)
+  {
+    if (l > 0) {delete level[l].A;}
+    delete[] level[l].invdiag;
+    delete[] level[l].b;
+    delete[] level[l].x;
+    delete[] level[l].r;
+  }
+  delete[] level;
+}
+
+void MultigridPreconditioner::smooth(const Level& L, const double* b, double* x, int sweeps) const
+{
+  const int n = L.A->n;
+  for (int s = 0; s < sweeps; s++)
+  {
+    L.A->mult(x, L.r);
+    for (int i = 0; i < n; i++)
+    {
+      x[i] += MG_OMEGA*L.invdiag[i]*(b[i] - L.r[i] - L.shift*x[i]);
+    }
+  }
+}
+
+void MultigridPreconditioner::vcycle(int l, const double* b, double* x) const
+{
+  const Level& L = level[l];
+  const int n = L.A->n;
+
+  // first sweep from x = 0 needs no product
+  for (int i = 0; i < n; i++)
+  {
+    x[i] = MG_OMEGA*L.invdiag[i]*b[i];
+  }
+  if (l == nlevels-1)
+  {
+    smooth(L, b, x, MG_COARSE_SWEEPS-1);
+    return;
+  }
+
+  // restrict the residual to the 2x2 aggregates
+  const Level& C = level[l+1];
+  L.A->mult(x, L.r);
+  for (int i = 0; i < C.A->n; i++)
+  {
+    C.b[i] = 0.0;
+  }
+  for (int y = 0; y < L.height; y++)
+  {
+    for (int xi = 0; xi < L.width; xi++)
+    {
+      int i = y*L.width + xi;
+      C.b[(y/2)*C.width + xi/2] += b[i] - L.r[i] - L.shift*x[i];
+    }
+  }
+
+  vcycle(l+1, C.b, C.x);
+
+  for (int y = 0; y < L.height; y++)
+  {
+    for (int xi = 0; xi < L.width; xi++)
+    {
+      x[y*L.width + xi] += C.x[(y/2)*C.width + xi/2];
+    }
+  }
+  smooth(L, b, x, 1);
+}
+
+void MultigridPreconditioner::apply(const double* in, double* out) const
+{
+  vcycle(0, in, out);
+}
+
+namespace
+{
+  // the solver proper, with the search space stored as Real
+  template <typename Real>
+  int _lobpcg(const LinearOperator& A, int nev, double* Evals, Real** Evecs,
+              const Preconditioner* T, double tol, int maxit, int* products,
+              const Real* start, int nstart, const LobpcgMonitor* monitor,
+              int* converged)
+  {
+    const int n = A.n;
+    if (nev > n)
+    {
+      cout << "LOBPCG: " << nev << " eigenpairs asked of an order " << n
+           << " operator." << endl;
+      for (int i = 0; i < nev; i++)
+      {
+        Evals[i] = 0.0;
+        std::fill(Evecs[i], Evecs[i]+n, Real(0));
+      }
+      if (products) {*products = 0;}
+      if (converged) {*converged = 0;}
+      return 0;
+    }
+    const int bs = _block_Size(nev, n);
+    int nprod = 0;
+
+    // S = [X P W], AS = A S; W may shrink, P is empty on the first pass
+    Real* S = new Real[(size_t)3*bs*n];
+    Real* AS = new Real[(size_t)3*bs*n];
+    Real* X = S;
+    Real* AX = AS;
+    vector<double> lambda(bs), resnorm(bs), buf(2*n);
+
+    // given start vectors first, the rest random with a fixed seed so runs
+    // are reproducible
+    nstart = start ? std::min(nstart, bs) : 0;
+    if (nstart > 0)
+    {
+      std::copy(start, start+(size_t)nstart*n, X);
+    }
+    cv::RNG rng(0x5eed);
+    for (size_t i = (size_t)nstart*n; i < (size_t)bs*n; i++)
+    {
+      X[i] = rng.uniform(-1.0, 1.0);
+    }
+    int kx = _svqb<Real>(X, NULL, bs, n);
+    for (int i = 0; i < kx; i++)
+    {
+      _mult(A, X+(size_t)i*n, AX+(size_t)i*n, &buf[0]);
+      nprod++;
+    }
+    // dependent start vectors
+    nprod += _refill(A, X, AX, kx, bs, n, rng, &buf[0]);
+
+    // Rayleigh-Ritz on X alone
+    {
+      vector<double> H(bs*bs), C(bs*bs);
+      _gram(X, bs, AX, bs, n, &H[0], true);
+      _sym_Eigen(&H[0], bs, &lambda[0], &C[0]);
+      _transform(X, n, bs, &C[0], bs, 0);
+      _transform(AX, n, bs, &C[0], bs, 0);
+    }
+
+    int np = 0;
+    int it = 0;
+    int lead = 0;
+    for (it = 1; it <= maxit; it++)
+    {
+      // residuals of the active (unconverged) vectors go to W
+      double scale = std::max(fabs(lambda[nev-1]), 1e-12);
+      Real* W = S + (size_t)(bs+np)*n;
+      Real* AW = AS + (size_t)(bs+np)*n;
+      int nw = 0;
+      bool done = true;
+      lead = nev;
+      for (int i = 0; i < bs; i++)
+      {
+        Real* w = W + (size_t)nw*n;
+        const Real* x = X + (size_t)i*n;
+        const Real* ax = AX + (size_t)i*n;
+        double s = 0.0;
+        for (int j = 0; j < n; j++)
+        {
+          double r = ax[j] - lambda[i]*x[j];
+          w[j] = r;
+          s += r*r;
+        }
+        resnorm[i] = sqrt(s);
+        if (resnorm[i] > tol*scale)
+        {
+          if (i < nev) {done = false;}
+          if (i < lead) {lead = i;}
+          nw++;
+        }
+      }
+      if (done) {break;}
+      if (monitor && monitor->stop(lead, &lambda[0], nev)) {break;}
+
+      if (T)
+      {
+        for (int i = 0; i < nw; i++)
+        {
+          _precondition(*T, W+(size_t)i*n, n, &buf[0]);
+        }
+      }
+
+      // P is kept orthonormal and orthogonal to X; W to both
+      if (np > 0)
+      {
+        Real* P = S + (size_t)bs*n;
+        Real* AP = AS + (size_t)bs*n;
+        _orthogonalize(P, AP, np, X, AX, bs, n);
+        int kp = _svqb(P, AP, np, n);
+        if (kp < np)
+        {
+          // keep the independent directions of P and move W up behind them
+          np = kp;
+          memmove(S + (size_t)(bs+np)*n, W, sizeof(Real)*nw*n);
+          W = S + (size_t)(bs+np)*n;
+          AW = AS + (size_t)(bs+np)*n;
+        }
+      }
+      for (int pass = 0; pass < 2; pass++)
+      {
+        _orthogonalize<Real>(W, NULL, nw, S, NULL, bs+np, n);
+        nw = _svqb<Real>(W, NULL, nw, n);
+      }
+      for (int i = 0; i < nw; i++)
+      {
+        _mult(A, W+(size_t)i*n, AW+(size_t)i*n, &buf[0]);
+        nprod++;
+      }
+
+      // Rayleigh-Ritz on the whole search space
+      int k = bs+np+nw;
+      vector<double> H(k*k), evals(k), C(k*k);
+      _gram(S, k, AS, k, n, &H[0], true);
+      _sym_Eigen(&H[0], k, &evals[0], &C[0]);
+
+      // X = S C, P = [P W] C with the X rows of C zeroed
+      vector<double> Cx(k*bs), Cp(k*bs, 0.0);
+      for (int row = 0; row < k; row++)
+      {
+        for (int i = 0; i < bs; i++)
+        {
+          Cx[row*bs+i] = C[row*k+i];
+          if (row >= bs) {Cp[row*bs+i] = C[row*k+i];}
+        }
+      }
+      _transform(S, n, k, &Cx[0], bs, 0, &Cp[0], bs, bs);
+      _transform(AS, n, k, &Cx[0], bs, 0, &Cp[0], bs, bs);
+      for (int i = 0; i < bs; i++)
+      {
+        lambda[i] = evals[i];
+      }
+      np = bs;
+
+      // X drifts away from orthonormality slowly
+      if (it % 8 == 0)
+      {
+        int kx = _svqb(X, AX, bs, n);
+        nprod += _refill(A, X, AX, kx, bs, n, rng, &buf[0]);
+        vector<double> Hx(bs*bs), Cxx(bs*bs);
+        _gram(X, bs, AX, bs, n, &Hx[0], true);
+        _sym_Eigen(&Hx[0], bs, &lambda[0], &Cxx[0]);
+        _transform(X, n, bs, &Cxx[0], bs, 0);
+        _transform(AX, n, bs, &Cxx[0], bs, 0);
+      }
+    }
+    if (it > maxit)
+    {
+      cout << "LOBPCG: maximum number of iterations reached." << endl;
+    }
+
+    for (int i = 0; i < nev; i++)
+    {
+      Evals[i] = lambda[i];
+      memcpy(Evecs[i], X+(size_t)i*n, sizeof(Real)*n);
+    }
+    if (products) {*products = nprod;}
+    if (converged) {*converged = lead;}
+
+    delete[] S;
+    delete[] AS;
+    return std::min(it, maxit);
+  }
+}
+
+int lobpcg(const LinearOperator& A, int nev, double* Evals, double** Evecs,
+           const Preconditioner* T, double tol, int maxit, int* products,
+           const double* start, int nstart, const LobpcgMonitor* monitor,
+           int* converged)
+{
+  return _lobpcg(A, nev, Evals, Evecs, T, tol, maxit, products, start, nstart,
+                 monitor, converged);
+}
+
+int lobpcg(const LinearOperator& A, int nev, double* Evals, float** Evecs,
+           const Preconditioner* T, double tol, int maxit, int* products,
+           const float* start, int nstart, const LobpcgMonitor* monitor,
+           int* converged)
+{
+  return _lobpcg(A, nev, Evals, Evecs, T, tol, maxit, products, start, nstart,
+                 monitor, converged);
+}
+
+size_t lobpcgMemory(int n, int nev, size_t elem)
+{
+  size_t bs = _block_Size(nev, n);
+  // S and AS, plus the double buffers for products
+  return 6*bs*n*elem + 2*(size_t)n*sizeof(double);
+}
@@ -9,60 +9,550 @@
 //
 
 #include "normCut.h"
+#include "lobpcg.h"
+#ifndef GPB_NO_ARPACK
 #include "dsaupd.h"
+#endif
+#ifdef GPB_MPI
+#include "pdsaupd.h"
+#endif
+#ifdef __unix__
+#include <sys/resource.h>
+#endif
 using namespace std;
 
+namespace
+{
+  // peak resident set size of the process in MB, 0 where unknown
+  static double
+  _peak_RSS()
+  {
+#ifdef __unix__
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0)
+      return usage.ru_maxrss/1024.0;
+#endif
+    return 0.0;
+  }
+
+  // eigensolver allocations in MB: eigenvectors of elem bytes, the sPb_raw
+  // planes when they are separate from them, start vectors and workspace
+  static double
+  _solver_MB(int n, int nev, int solver, size_t elem, int ncv, int nstart)
+  {
+    size_t bytes = (size_t)nev*n*elem;
+    if(elem != sizeof(float))
+      bytes += (size_t)(nev-1)*n*sizeof(float);
+    if(solver == NCUT_LOBPCG)
+      bytes += lobpcgMemory(n, nev, elem) + (size_t)nstart*n*elem;
+#ifndef GPB_NO_ARPACK
+    else
+      bytes += dsaupdMemory(n, ncv) + (nstart ? 2*(size_t)n*sizeof(double) : 0);
+#endif
+    return bytes/1048576.0;
+  }
+
+  // start vector i in the solver basis v = D^1/2 y.  the start planes are
+  // affine maps of eigenvectors y, so with y = 1 (the trivial eigenvector,
+  // i = 0) they span the same space.
+  template <typename Real>
+  static void
+  _start_Vector(const vector<cv::Mat> & start, int i, const double *D,
+		int rows, int cols, Real *v)
+  {
+    if(i == 0){
+      for(int j=0; j<rows*cols; j++)
+	v[j] = D[j];
+      return;
+    }
+    const cv::Mat & plane = start[i-1];
+    for(int r=0; r<rows; r++){
+      const float *p = plane.ptr<float>(r);
+      for(int c=0; c<cols; c++)
+	v[r*cols+c] = D[r*cols+c]*p[c];
+    }
+  }
+
+  // ends LOBPCG once the time budget is spent, or once the first
+  // unconverged eigenvector would add less than min_contribution of the
+  // sPb weight 1/sqrt(lambda) of the converged ones (the trivial one aside)
+  struct BudgetMonitor : public LobpcgMonitor
+  {
+    double seconds;
+    double min_contribution;
+    int64 t0;
+    mutable bool fired;   // stop() has ended the iteration
+
+    bool stop(int converged, const double *lambda, int nev) const
+    {
+      if(seconds > 0 && (cv::getTickCount()-t0)/cv::getTickFrequency() > seconds)
+	return fired = true;
+      if(min_contribution <= 0 || converged < 2 || converged >= nev)
+	return false;
+      double sum = 0.0;
+      for(int i=1; i<converged; i++)
+	sum += 1/sqrt(std::max(lambda[i], 1e-12));
+      fired = 1/sqrt(std::max(lambda[converged], 1e-12)) < min_contribution*sum;
+      return fired;
+    }
+  };
+
+  // runs the selected eigensolver on the normalized W, eigenvectors into
+  // Evecs; converged receives how many leading ones converged when the
+  // anytime monitor ended the iteration, nev otherwise.  returns the
+  // number of iterations.
+  template <typename Real>
+  static int
+  _solve(const LinearOperator & W, int rows, int cols, const double *D,
+	 int nev, const cv::NCutOptions & options, int solver, int ncv,
+	 const vector<cv::Mat> * start, double *Evals, Real **Evecs,
+	 int & products, int & converged)
+  {
+    int n = rows*cols;
+    int nstart = 0;
+    if(start && !start->empty())
+      nstart = std::min((int)start->size()+1, nev);
+
+    int iterations = 0;
+    converged = nev;
+    if(solver == NCUT_LOBPCG){
+      vector<Real> block((size_t)nstart*n);
+      for(int i=0; i<nstart; i++)
+	_start_Vector(*start, i, D, rows, cols, &block[(size_t)i*n]);
+      Preconditioner *T = NULL;
+      if(options.precond == NCUT_PRECOND_JACOBI)
+	T = new JacobiPreconditioner(W, options.precond_shift);
+      else if(options.precond == NCUT_PRECOND_MULTIGRID && W.n == n)
+	T = new MultigridPreconditioner(W, cols, rows, options.precond_shift);
+      BudgetMonitor monitor;
+      monitor.seconds = options.time_budget;
+      monitor.min_contribution = options.min_contribution;
+      monitor.t0 = cv::getTickCount();
+      monitor.fired = false;
+      bool anytime = options.time_budget > 0 || options.min_contribution > 0;
+      int leading = nev;
+      iterations = lobpcg(W, nev, Evals, Evecs, T, options.tol, options.maxit, &products,
+			  nstart ? &block[0] : NULL, nstart,
+			  anytime ? &monitor : NULL, &leading);
+      // a run that merely hit maxit keeps all its Ritz pairs, as before
+      if(monitor.fired)
+	converged = leading;
+      delete T;
+      cout<<"LOBPCG: ";
+    }
+#ifndef GPB_NO_ARPACK
+    else{
+      // ARPACK takes a single start vector: the sum of the normalized
+      // start vectors
+      vector<double> resid0, v;
+      if(nstart > 0){
+	resid0.assign(n, 0.0);
+	v.resize(n);
+      }
+      for(int i=0; i<nstart; i++){
+	_start_Vector(*start, i, D, rows, cols, &v[0]);
+	double norm = 0.0;
+	for(int j=0; j<n; j++)
+	  norm += v[j]*v[j];
+	norm = sqrt(norm);
+	if(norm == 0.0)
+	  continue;
+	for(int j=0; j<n; j++)
+	  resid0[j] += v[j]/norm;
+      }
+      const double *r0 = resid0.empty() ? NULL : &resid0[0];
+      if(options.mode == NCUT_MODE_AFFINITY){
+	iterations = dsaupd(W, nev, Evals, Evecs, &products, "LA", options.affinity_tol, r0, ncv);
+	// eigenvalues of L from those of the shifted normalized affinity
+	for (size_t i=0; i<nev; i++)
+	  Evals[i] = 1.0 + options.shift - Evals[i];
+	cout<<"ARPACK (LA): ";
+      }else{
+	iterations = dsaupd(W, nev, Evals, Evecs, &products, "SM", 1e-3, r0, ncv);
+	cout<<"ARPACK: ";
+      }
+    }
+#endif
+    return iterations;
+  }
+  // entries per parallel work item in the sPb_raw post-processing
+  const int RAW_CHUNK = 16384;
+
+  // range of y = v/D over one chunk of entries, for each vector
+  template <typename Real>
+  struct parallelInvoker_range
+  {
+    const Real* const* in;
+    int nvec;
+    const double *D;
+    int n;
+    double *lo;   // nvec per chunk
+    double *hi;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      for (int c = range.begin(); c < range.end(); c++){
+	int j0 = c*RAW_CHUNK;
+	int j1 = std::min(n, j0+RAW_CHUNK);
+	for (int i = 0; i < nvec; i++){
+	  const Real *v = in[i];
+	  double min_p = v[j0]/D[j0], max_p = min_p;
+	  for (int j = j0+1; j < j1; j++){
+	    double y = v[j]/D[j];
+	    min_p = std::min(min_p, y);
+	    max_p = std::max(max_p, y);
+	  }
+	  lo[(size_t)c*nvec+i] = min_p;
+	  hi[(size_t)c*nvec+i] = max_p;
+	}
+      }
+    }
+  };
+
+  // out = (v/D - offset)*scale, which may be written over v
+  template <typename Real>
+  struct parallelInvoker_rawPlanes
+  {
+    const Real* const* in;
+    float* const* out;
+    int nvec;
+    const double *D;
+    int n;
+    const double *offset;
+    const double *scale;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      for (int c = range.begin(); c < range.end(); c++){
+	int j0 = c*RAW_CHUNK;
+	int j1 = std::min(n, j0+RAW_CHUNK);
+	for (int i = 0; i < nvec; i++){
+	  const Real *v = in[i];
+	  float *o = out[i];
+	  for (int j = j0; j < j1; j++)
+	    o[j] = (float)((v[j]/D[j] - offset[i])*scale[i]);
+	}
+      }
+    }
+  };
+
+  // sPb_raw[i-1] = (y_i - min y_i)/(max y_i - min y_i)/sqrt(lambda_i) for
+  // the eigenvectors y = D^-1/2 v but the first, smallest eigenvalue of L
+  // first: one read-only pass for the ranges, one to write the planes.
+  // planes, when given, hold the float eigenvectors and become sPb_raw.
+  template <typename Real>
+  static void
+  _raw_Planes(Real **Evecs, const double *Evals, int nev, const double *D,
+	      int rows, int cols, const vector<cv::Mat> * planes,
+	      vector<cv::Mat> & sPb_raw)
+  {
+    int n = rows*cols;
+    // smallest eigenvalue of L first, whatever order the solver used
+    vector<int> order(nev);
+    for (int i=0; i<nev; i++)
+      order[i] = i;
+    for (int i=1; i<nev; i++)
+      for (int j=i; j>0 && Evals[order[j]] < Evals[order[j-1]]; j--)
+	std::swap(order[j], order[j-1]);
+
+    int nvec = nev-1;
+    vector<const Real*> in(nvec);
+    vector<float*> out(nvec);
+    sPb_raw.resize(nvec);
+    for (int i=0; i<nvec; i++){
+      in[i] = Evecs[order[i+1]];
+      if(planes)
+	sPb_raw[i] = (*planes)[order[i+1]];
+      else
+	sPb_raw[i].create(rows, cols, CV_32FC1);
+      out[i] = sPb_raw[i].ptr<float>(0);
+    }
+
+    int nchunks = (n+RAW_CHUNK-1)/RAW_CHUNK;
+    vector<double> lo((size_t)nchunks*nvec), hi((size_t)nchunks*nvec);
+    parallelInvoker_range<Real> range;
+    range.in = &in[0];
+    range.nvec = nvec;
+    range.D = D;
+    range.n = n;
+    range.lo = &lo[0];
+    range.hi = &hi[0];
+    cv::parallel_for(cv::BlockedRange(0, nchunks), range);
+
+    vector<double> offset(nvec), scale(nvec);
+    for (int i=0; i<nvec; i++){
+      double min_p = lo[i], max_p = hi[i];
+      for (int c=1; c<nchunks; c++){
+	min_p = std::min(min_p, lo[(size_t)c*nvec+i]);
+	max_p = std::max(max_p, hi[(size_t)c*nvec+i]);
+      }
+      offset[i] = min_p;
+      scale[i] = 1/(max_p-min_p)/sqrt(Evals[order[i+1]]);
+    }
+
+    parallelInvoker_rawPlanes<Real> map;
+    map.in = &in[0];
+    map.out = &out[0];
+    map.nvec = nvec;
+    map.D = D;
+    map.n = n;
+    map.offset = &offset[0];
+    map.scale = &scale[0];
+    cv::parallel_for(cv::BlockedRange(0, nchunks), map);
+  }
+
+#ifdef GPB_MPI
+  // _raw_Planes for eigenvectors split in row strips: the ranges are
+  // reduced over all ranks, each rank maps its own rows and rank 0
+  // gathers the planes of the whole image
+  static void
+  _strip_Planes(MPI_Comm comm, double **Evecs, const double *Evals, int nev,
+		const double *D, int rows, int cols, vector<cv::Mat> & sPb_raw)
+  {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    int n = rows*cols;
+    vector<int> order(nev);
+    for (int i=0; i<nev; i++)
+      order[i] = i;
+    for (int i=1; i<nev; i++)
+      for (int j=i; j>0 && Evals[order[j]] < Evals[order[j-1]]; j--)
+	std::swap(order[j], order[j-1]);
+
+    int nvec = nev-1;
+    vector<const double*> in(nvec);
+    vector<float> local((size_t)nvec*n);
+    vector<float*> out(nvec);
+    for (int i=0; i<nvec; i++){
+      in[i] = Evecs[order[i+1]];
+      out[i] = &local[(size_t)i*n];
+    }
+
+    int nchunks = (n+RAW_CHUNK-1)/RAW_CHUNK;
+    vector<double> lo((size_t)nchunks*nvec), hi((size_t)nchunks*nvec);
+    parallelInvoker_range<double> range;
+    range.in = &in[0];
+    range.nvec = nvec;
+    range.D = D;
+    range.n = n;
+    range.lo = &lo[0];
+    range.hi = &hi[0];
+    cv::parallel_for(cv::BlockedRange(0, nchunks), range);
+
+    vector<double> min_p(lo.begin(), lo.begin()+nvec), max_p(hi.begin(), hi.begin()+nvec);
+    for (int i=0; i<nvec; i++)
+      for (int c=1; c<nchunks; c++){
+	min_p[i] = std::min(min_p[i], lo[(size_t)c*nvec+i]);
+	max_p[i] = std::max(max_p[i], hi[(size_t)c*nvec+i]);
+      }
+    MPI_Allreduce(MPI_IN_PLACE, &min_p[0], nvec, MPI_DOUBLE, MPI_MIN, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &max_p[0], nvec, MPI_DOUBLE, MPI_MAX, comm);
+
+    vector<double> offset(nvec), scale(nvec);
+    for (int i=0; i<nvec; i++){
+      offset[i] = min_p[i];
+      scale[i] = 1/(max_p[i]-min_p[i])/sqrt(Evals[order[i+1]]);
+    }
+
+    parallelInvoker_rawPlanes<double> map;
+    map.in = &in[0];
+    map.out = &out[0];
+    map.nvec = nvec;
+    map.D = D;
+    map.n = n;
+    map.offset = &offset[0];
+    map.scale = &scale[0];
+    cv::parallel_for(cv::BlockedRange(0, nchunks), map);
+
+    // strips are in rank order, top to bottom
+    vector<int> counts(size), displs(size, 0);
+    MPI_Gather(&n, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, comm);
+    int total = n;
+    if(rank == 0){
+      for (int r=1; r<size; r++)
+	displs[r] = displs[r-1] + counts[r-1];
+      total = displs[size-1] + counts[size-1];
+      sPb_raw.resize(nvec);
+    }
+    for (int i=0; i<nvec; i++){
+      float *plane = NULL;
+      if(rank == 0){
+	sPb_raw[i].create(total/cols, cols, CV_32FC1);
+	plane = sPb_raw[i].ptr<float>(0);
+      }
+      MPI_Gatherv(out[i], n, MPI_FLOAT, plane, &counts[0], &displs[0], MPI_FLOAT,
+		  0, comm);
+    }
+  }
+#endif
+}
+
 namespace cv{
-void normalise_cut(double **T, //symmetric sparse matrix - Affinity Matrix
-		   int tlen,   //the number of elements 
-		   int rows,   //matrix order, also the length of diagnal matrix
+void normalise_cut(LinearOperator & W,  //symmetric sparse matrix - Affinity Matrix
+		   int rows,    //matrix order, also the length of diagnal matrix
 		   int cols,
-		   double *D,  //square root of Diagnoal matrix
-		   int nev,    //The number of eigenvector desired
+		   double *D,   //square root of Diagnoal matrix
+		   int nev,     //The number of eigenvector desired
 		   //outputs:
-		   vector<cv::Mat> & sPb_raw)    
+		   vector<cv::Mat> & sPb_raw,
+		   const NCutOptions & options,
+		   const vector<cv::Mat> * start)    
 {
-  double **Evecs, *Evals;
+  double **Evecs = NULL, *Evals;
   int n = rows*cols;
-  for(size_t i = 0; i<tlen; i++){
-    if(T[i][0] == T[i][1])
-      T[i][2] = (pow(D[int(T[i][0])], 2)-T[i][2])/D[int(T[i][0])]/D[int(T[i][1])];
-    else
-      T[i][2] = -T[i][2]/D[int(T[i][0])]/D[int(T[i][1])];
+  int solver = options.solver;
+#ifdef GPB_NO_ARPACK
+  solver = NCUT_LOBPCG;
+#endif
+  // ARPACK cannot hand back part of its eigenpairs
+  if(options.time_budget > 0 || options.min_contribution > 0)
+    solver = NCUT_LOBPCG;
+  bool affinity = (solver == NCUT_ARPACK && options.mode == NCUT_MODE_AFFINITY);
+  if(affinity)
+    // W -> D^-1/2 W D^-1/2 + shift I, in place
+    W.normalizeAffinity(D, options.shift);
+  else
+    // W -> I - D^-1/2 W D^-1/2, in place
+    W.normalize(D);
+
+  // memory: the lean settings when asked for or when the defaults do not
+  // fit the cap, then the ARPACK basis shrinks down to nev+2 vectors, then
+  // fewer eigenvectors down to one sPb_raw plane; past that, none at all
+  int nstart = (start && !start->empty()) ? std::min((int)start->size()+1, nev) : 0;
+  bool lean = options.lean;
+  int ncv = lean ? 2*nev+1 : 4*nev;
+  double cap = options.max_memory_mb;
+  double need = _solver_MB(n, nev, solver, lean ? sizeof(float) : sizeof(double), ncv, nstart);
+  if(cap > 0 && need > cap && !lean){
+    lean = true;
+    ncv = 2*nev+1;
+    need = _solver_MB(n, nev, solver, sizeof(float), ncv, nstart);
+  }
+  while(cap > 0 && need > cap && solver == NCUT_ARPACK && ncv > nev+2){
+    ncv--;
+    need = _solver_MB(n, nev, solver, sizeof(float), ncv, nstart);
   }
-  
+  int wanted = nev;
+  while(cap > 0 && need > cap && nev > 2){
+    nev--;
+    ncv = nev+2;
+    nstart = std::min(nstart, nev);
+    need = _solver_MB(n, nev, solver, sizeof(float), ncv, nstart);
+  }
+  if(cap > 0 && need > cap){
+    cerr<<"normalise_cut: error: "<<need<<" MB needed, cannot keep within "
+	<<cap<<" MB, no sPb_raw"<<endl;
+    sPb_raw.clear();
+    return;
+  }
+  cout<<"eigensolver memory: "<<need<<" MB";
+  if(lean)
+    cout<<" (lean";
+  if(lean && solver == NCUT_ARPACK)
+    cout<<", ncv = "<<ncv;
+  if(lean)
+    cout<<")";
+  if(nev < wanted)
+    cout<<", "<<nev<<" of "<<wanted<<" eigenvectors";
+  cout<<endl;
+
   Evals = new double[nev];
-  Evecs = new double*[nev];
-  for (size_t i=0; i<nev; i++) 
-    Evecs[i] = new double[n];
-
-  dsaupd(T, tlen, n, nev, Evals, Evecs);
-
-  sPb_raw.resize(nev-1);
-  cv::Mat ones = cv::Mat::ones(rows, cols, CV_32FC1);
-  for (size_t i=1; i<nev; i++){
-    double max_p, min_p;
-    for(size_t j=0; j<n; j++){
-      Evecs[i][j] = Evecs[i][j]/D[j];
-      if(j == 0){
-	max_p = Evecs[i][j];
-	min_p = Evecs[i][j];
-      }else{
-	if(max_p < Evecs[i][j])
-	  max_p = Evecs[i][j];
-	if(min_p > Evecs[i][j])
-	  min_p = Evecs[i][j];
-      }
+  int64 t0 = cv::getTickCount();
+  int iterations = 0, products = 0, converged = nev;
+  vector<cv::Mat> planes;
+  vector<float*> Evecs_f;
+  double *basis = NULL;
+  if(lean){
+    // float eigenvectors, written straight into the planes that become
+    // sPb_raw
+    planes.resize(nev);
+    Evecs_f.resize(nev);
+    for (size_t i=0; i<nev; i++){
+      planes[i].create(rows, cols, CV_32FC1);
+      Evecs_f[i] = planes[i].ptr<float>(0);
     }
-    sPb_raw[i-1] = cv::Mat(rows, cols, CV_64FC1, Evecs[i]);
-    sPb_raw[i-1].convertTo(sPb_raw[i-1], CV_32FC1);
-    cv::addWeighted(sPb_raw[i-1], 1.0, ones, -min_p, 0.0, sPb_raw[i-1]);
-    cv::multiply(sPb_raw[i-1], ones, sPb_raw[i-1], 1/(max_p-min_p)/sqrt(Evals[i]));
+    iterations = _solve(W, rows, cols, D, nev, options, solver, ncv, start,
+			Evals, &Evecs_f[0], products, converged);
+  }else{
+    basis = new double[(size_t)nev*n];
+    Evecs = new double*[nev];
+    for (size_t i=0; i<nev; i++) 
+      Evecs[i] = basis + (size_t)i*n;
+    iterations = _solve(W, rows, cols, D, nev, options, solver, ncv, start,
+			Evals, Evecs, products, converged);
   }
+  cout<<iterations<<" iterations, "<<products<<" products, "
+      <<(cv::getTickCount()-t0)/cv::getTickFrequency()<<" s, peak RSS "
+      <<_peak_RSS()<<" MB"<<endl;
+
+  // stopped early: the leading converged pairs, and at least one plane
+  int used = nev;
+  if(converged < nev){
+    used = std::max(converged, 2);
+    cout<<"stopped with "<<converged<<" of "<<nev<<" eigenpairs converged, "
+	<<used-1<<" sPb_raw planes"<<endl;
+  }
+  if(lean)
+    _raw_Planes(&Evecs_f[0], Evals, used, D, rows, cols, &planes, sPb_raw);
+  else
+    _raw_Planes(Evecs, Evals, used, D, rows, cols, NULL, sPb_raw);
+
   //clean up
+  if(!lean)
+    delete[] Evecs;
+  delete[] basis;
+  delete[] Evals;
+}
+
+#ifdef GPB_MPI
+void normalise_cut(StripMatrix & W,
+		   int rows,
+		   int cols,
+		   double *D,
+		   int nev,
+		   vector<cv::Mat> & sPb_raw,
+		   const NCutOptions & options)
+{
+  int rank;
+  MPI_Comm_rank(W.comm, &rank);
+  int n = rows*cols;
+  bool affinity = (options.mode == NCUT_MODE_AFFINITY);
+  if(affinity)
+    W.normalizeAffinity(D, options.shift);
+  else
+    W.normalize(D);
+
+  int ncv = 4*nev;
+  if(rank == 0)
+    cout<<"eigensolver memory: "<<pdsaupdMemory(n, ncv)/1048576.0
+	<<" MB on rank 0"<<endl;
+
+  double *Evals = new double[nev];
+  double *basis = new double[(size_t)nev*n];
+  double **Evecs = new double*[nev];
+  for (size_t i=0; i<nev; i++)
+    Evecs[i] = basis + (size_t)i*n;
+  int64 t0 = cv::getTickCount();
+  int iterations, products = 0;
+  if(affinity){
+    iterations = pdsaupd(W.comm, W, nev, Evals, Evecs, &products, "LA",
+			 options.affinity_tol, ncv);
+    for (size_t i=0; i<nev; i++)
+      Evals[i] = 1.0 + options.shift - Evals[i];
+  }else
+    iterations = pdsaupd(W.comm, W, nev, Evals, Evecs, &products, "SM", 1e-3, ncv);
+  if(rank == 0)
+    cout<<"PARPACK"<<(affinity ? " (LA)" : "")<<": "<<iterations<<" iterations, "
+	<<products<<" products, "<<(cv::getTickCount()-t0)/cv::getTickFrequency()
+	<<" s, peak RSS "<<_peak_RSS()<<" MB on rank 0"<<endl;
+
+  _strip_Planes(W.comm, Evecs, Evals, nev, D, rows, cols, sPb_raw);
+
   delete[] Evecs;
+  delete[] basis;
   delete[] Evals;
-  ones.release();
 }
+#endif
 
 }
@@ -21,54 +21,562 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <algorithm>
+#include <opencv/cv.h>
 #include "smatrix.h"
 
-SMatrix::SMatrix (int n, int* nz, int** col, double** values)
+namespace
+{
+  // nonzeros handled by one parallel work item
+  const int SPMV_BLOCK_NNZ = 16384;
+
+  struct parallelInvoker_spmv
+  {
+    const int* row;
+    const int* col;
+    const float* values;
+    const int* blocks;
+    const double* in;
+    double* out;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      for (int b = range.begin(); b < range.end(); b++)
+      {
+        for (int i = blocks[b]; i < blocks[b+1]; i++)
+        {
+          // four partial sums so the gathers can overlap
+          int k = row[i];
+          const int end = row[i+1];
+          double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+          for (; k+3 < end; k += 4)
+          {
+            s0 += values[k]   * in[col[k]];
+            s1 += values[k+1] * in[col[k+1]];
+            s2 += values[k+2] * in[col[k+2]];
+            s3 += values[k+3] * in[col[k+3]];
+          }
+          for (; k < end; k++)
+          {
+            s0 += values[k] * in[col[k]];
+          }
+          out[i] = (s0+s1)+(s2+s3);
+        }
+      }
+    }
+  };
+
+  // symmetric product from the upper triangle: row r adds its entries to
+  // out[r] and scatters them to out[c].  only every other block is run at
+  // once so no two threads touch the same out[].
+  struct parallelInvoker_spmv_sym
+  {
+    const int* row;
+    const int* col;
+    const float* values;
+    const int* blocks;
+    const double* in;
+    double* out;
+    int parity;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      for (int b = 2*range.begin()+parity; b < 2*range.end()+parity; b += 2)
+      {
+        for (int i = blocks[b]; i < blocks[b+1]; i++)
+        {
+          const double x_i = in[i];
+          double s = 0.0;
+          for (int k = row[i]; k < row[i+1]; k++)
+          {
+            const int c = col[k];
+            s += values[k] * in[c];
+            if (c != i)
+            {
+              out[c] += values[k] * x_i;
+            }
+          }
+          out[i] += s;
+        }
+      }
+    }
+  };
+
+  // averages each pair (r,c), (c,r) with r < c from row r, finding (c,r)
+  // by bisection in row c; every pair has one owner so rows can run in
+  // any order.
+  struct parallelInvoker_symmetrize
+  {
+    const int* row;
+    const int* col;
+    float* values;
+    const int* blocks;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      for (int b = range.begin(); b < range.end(); b++)
+      {
+        for (int r = blocks[b]; r < blocks[b+1]; r++)
+        {
+          const int* first = std::upper_bound(col+row[r], col+row[r+1], r);
+          for (int i = first - col; i < row[r+1]; i++)
+          {
+            int c = col[i];
+            int j = std::lower_bound(col+row[c], col+row[c+1], r) - col;
+            assert( j < row[c+1] && col[j] == r );
+            float v_rc = values[i];
+            float v_cr = values[j];
+            values[i] = 0.5f*(v_rc+v_cr);
+            values[j] = 0.5f*(v_rc+v_cr);
+          }
+        }
+      }
+    }
+  };
+
+  struct parallelInvoker_stencil
+  {
+    const StencilMatrix* S;
+    const double* in;
+    double* out;
+
+    void operator()(const cv::BlockedRange & range) const
+    {
+      const int width = S->width;
+      const int height = S->height;
+      for (int y = range.begin(); y < range.end(); y++)
+      {
+        double* o = out + (size_t)y*width;
+        for (int x = 0; x < width; x++)
+        {
+          o[x] = 0.0;
+        }
+        // one contiguous weight run and one contiguous input run per offset
+        for (int k = 0; k < S->K; k++)
+        {
+          int yy = y + S->du[k];
+          if (yy < 0 || yy >= height) {continue;}
+          int x0 = std::max(0, -S->dv[k]);
+          int x1 = std::min(width, width - S->dv[k]);
+          const float* w = S->weights + (size_t)k*S->n + (size_t)y*width;
+          const double* src = in + (size_t)yy*width + S->dv[k];
+          for (int x = x0; x < x1; x++)
+          {
+            o[x] += w[x] * src[x];
+          }
+        }
+      }
+    }
+  };
+}
+
+SMatrix::SMatrix (int n, int* row, int* col, float* values)
 {
     this->n = n;
-    this->nz = nz;
+    this->row = row;
     this->col = col;
     this->values = values;
-    int nnz = 0;
-    for (int i = 0; i < n; i++)
-      nnz += nz[i];
+    this->nnz = row[n];
+    this->upper = false;
+    this->bandwidth = 0;
+    partition();
     //printf("sparse matrix\n");//TODO what do with std spam?
     //Util::Message::debug(Util::String("creating sparse matrix with %d nonzero entries",nnz));
 }
 
 SMatrix::~SMatrix ()
 {
-  for (int i = 0; i < n; i++)
+  delete[] row;
+  delete[] col;
+  delete[] values;
+  delete[] blocks;
+}
+
+void SMatrix::partition()
+{
+  int max_blocks = nnz/SPMV_BLOCK_NNZ + 1;
+  blocks = new int[max_blocks+1];
+  nblocks = 0;
+  blocks[0] = 0;
+  for (int r = 0; r < n; r++) 
+  {
+    if (row[r+1] - row[blocks[nblocks]] >= SPMV_BLOCK_NNZ && 
+        r+1 - blocks[nblocks] >= bandwidth && nblocks+1 < max_blocks)
+    {
+      blocks[++nblocks] = r+1;
+    }
+  }
+  if (blocks[nblocks] != n)
+  {
+    // a short last block would let its predecessor scatter past it
+    if (nblocks > 0 && n - blocks[nblocks] < bandwidth)
+    {
+      nblocks--;
+    }
+    blocks[++nblocks] = n;
+  }
+}
+
+void SMatrix::sparsify(float epsilon)
+{
+  int kept = 0;
+  for (int r = 0; r < n; r++)
+  {
+    for (int i = row[r]; i < row[r+1]; i++)
+    {
+      if (col[i] == r || values[i] >= epsilon) {kept++;}
+    }
+  }
+
+  // copy into right-sized arrays so the dropped entries are freed
+  int* srow = new int[n+1];
+  int* scol = new int[kept];
+  float* svalues = new float[kept];
+  int k = 0;
+  for (int r = 0; r < n; r++)
+  {
+    srow[r] = k;
+    for (int i = row[r]; i < row[r+1]; i++)
+    {
+      if (col[i] == r || values[i] >= epsilon)
+      {
+        scol[k] = col[i];
+        svalues[k] = values[i];
+        k++;
+      }
+    }
+  }
+  srow[n] = k;
+
+  delete[] row;
+  delete[] col;
+  delete[] values;
+  delete[] blocks;
+  row = srow;
+  col = scol;
+  values = svalues;
+  nnz = kept;
+  partition();
+}
+
+void SMatrix::dropLower()
+{
+  if (upper) {return;}
+  int kept = 0;
+  bandwidth = 0;
+  for (int r = 0; r < n; r++)
+  {
+    for (int i = row[r]; i < row[r+1]; i++)
+    {
+      if (col[i] >= r) 
+      {
+        kept++;
+        bandwidth = std::max(bandwidth, col[i]-r);
+      }
+    }
+  }
+
+  // copy into right-sized arrays so the lower half is actually freed
+  int* urow = new int[n+1];
+  int* ucol = new int[kept];
+  float* uvalues = new float[kept];
+  int k = 0;
+  for (int r = 0; r < n; r++)
+  {
+    urow[r] = k;
+    for (int i = row[r]; i < row[r+1]; i++)
+    {
+      if (col[i] >= r)
+      {
+        ucol[k] = col[i];
+        uvalues[k] = values[i];
+        k++;
+      }
+    }
+  }
+  urow[n] = k;
+
+  delete[] row;
+  delete[] col;
+  delete[] values;
+  delete[] blocks;
+  row = urow;
+  col = ucol;
+  values = uvalues;
+  nnz = kept;
+  upper = true;
+  partition();
+}
+
+void SMatrix::mult(const double* in, double* out) const
+{
+  if (upper)
+  {
+    memset(out, 0, sizeof(double)*n);
+    parallelInvoker_spmv_sym parallel;
+    parallel.row = row;
+    parallel.col = col;
+    parallel.values = values;
+    parallel.blocks = blocks;
+    parallel.in = in;
+    parallel.out = out;
+    for (parallel.parity = 0; parallel.parity < 2; parallel.parity++)
+    {
+      int count = (nblocks - parallel.parity + 1)/2;
+      cv::parallel_for(cv::BlockedRange(0, count), parallel);
+    }
+    return;
+  }
+
+  parallelInvoker_spmv parallel;
+  parallel.row = row;
+  parallel.col = col;
+  parallel.values = values;
+  parallel.blocks = blocks;
+  parallel.in = in;
+  parallel.out = out;
+  cv::parallel_for(cv::BlockedRange(0, nblocks), parallel);
+}
+
+void SMatrix::rowSums(double* D) const
+{
+  if (upper)
+  {
+    memset(D, 0, sizeof(double)*n);
+    for (int r = 0; r < n; r++)
+    {
+      for (int i = row[r]; i < row[r+1]; i++)
+      {
+        D[r] += static_cast<double>(values[i]);
+        if (col[i] != r) 
+        {
+          D[col[i]] += static_cast<double>(values[i]);
+        }
+      }
+    }
+    return;
+  }
+
+  for (int r = 0; r < n; r++)
+  {
+    D[r] = 0.0;
+    for (int i = row[r]; i < row[r+1]; i++)
+    {
+      D[r] += static_cast<double>(values[i]);
+    }
+  }
+}
+
+void SMatrix::normalize(const double* D)
+{
+  for (int r = 0; r < n; r++)
+  {
+    for (int i = row[r]; i < row[r+1]; i++)
+    {
+      int c = col[i];
+      if (r == c)
+      {
+        values[i] = float((D[r]*D[r]-values[i])/D[r]/D[c]);
+      }
+      else
+      {
+        values[i] = float(-values[i]/D[r]/D[c]);
+      }
+    }
+  }
+}
+
+void SMatrix::normalizeAffinity(const double* D, double shift)
+{
+  for (int r = 0; r < n; r++)
   {
-    delete[] col[i];
-    delete[] values[i];
+    for (int i = row[r]; i < row[r+1]; i++)
+    {
+      int c = col[i];
+      values[i] = float(values[i]/D[r]/D[c] + (r == c ? shift : 0.0));
+    }
   }
-  delete col;
-  delete values;
-  delete nz;
+}
+
+int SMatrix::storedRow(int r, int* cols, float* vals) const
+{
+  int count = row[r+1] - row[r];
+  memcpy(cols, col + row[r], sizeof(int)*count);
+  memcpy(vals, values + row[r], sizeof(float)*count);
+  return count;
+}
+
+int SMatrix::maxRowEntries() const
+{
+  int m = 0;
+  for (int r = 0; r < n; r++)
+  {
+    m = std::max(m, row[r+1] - row[r]);
+  }
+  return m;
 }
 
 void SMatrix::symmetrize()
 {
-  int* tail = new int[n];  
-  memset(tail,0,n*sizeof(int));
-  for (int r = 0; r < n; r++) 
+  parallelInvoker_symmetrize parallel;
+  parallel.row = row;
+  parallel.col = col;
+  parallel.values = values;
+  parallel.blocks = blocks;
+  cv::parallel_for(cv::BlockedRange(0, nblocks), parallel);
+}
+
+
+StencilMatrix::StencilMatrix (int width, int height, float dthresh)
+{
+  this->width = width;
+  this->height = height;
+  this->n = width*height;
+
+  // same disc and ordering as computeAffinities2, so plane k holds the
+  // k-th entry of each CSR row
+  int dthreshi = (int)ceil(dthresh);
+  K = 0;
+  for (int u = -dthreshi; u <= dthreshi; u++)
   {
-    int offset = 0;
-    while ((offset < nz[r]) && (col[r][offset] < r+1))
+    for (int v = -dthreshi; v <= dthreshi; v++)
     {
-      offset++;
+      if (u*u+v*v <= dthresh*dthresh) {K++;}
     }
-    for (int i = offset; i < nz[r]; i++) 
+  }
+  du = new int[K];
+  dv = new int[K];
+  int k = 0;
+  for (int u = -dthreshi; u <= dthreshi; u++)
+  {
+    for (int v = -dthreshi; v <= dthreshi; v++)
     {
-      int c = col[r][i];
-      assert( col[c][tail[c]] == r ); 
-      double v_rc = values[r][i];
-      double v_cr = values[c][tail[c]];
-      values[r][i] = 0.5*(v_rc+v_cr);
-      values[c][tail[c]] = 0.5*(v_rc+v_cr);
-      tail[c]++;
+      if (u*u+v*v <= dthresh*dthresh) 
+      {
+        du[k] = u;
+        dv[k] = v;
+        k++;
+      }
     }
-  }  
+  }
+  weights = new float[(size_t)K*n];
+  memset(weights, 0, sizeof(float)*(size_t)K*n);
 }
 
+StencilMatrix::~StencilMatrix ()
+{
+  delete[] du;
+  delete[] dv;
+  delete[] weights;
+}
+
+void StencilMatrix::mult(const double* in, double* out) const
+{
+  parallelInvoker_stencil parallel;
+  parallel.S = this;
+  parallel.in = in;
+  parallel.out = out;
+  cv::parallel_for(cv::BlockedRange(0, height), parallel);
+}
+
+void StencilMatrix::rowSums(double* D) const
+{
+  for (int i = 0; i < n; i++)
+  {
+    D[i] = 0.0;
+  }
+  // entries outside the image are stored as zero
+  for (int k = 0; k < K; k++)
+  {
+    const float* w = weights + (size_t)k*n;
+    for (int i = 0; i < n; i++)
+    {
+      D[i] += static_cast<double>(w[i]);
+    }
+  }
+}
+
+void StencilMatrix::normalize(const double* D)
+{
+  for (int k = 0; k < K; k++)
+  {
+    float* w = plane(k);
+    const bool diag = (du[k] == 0 && dv[k] == 0);
+    const int off = du[k]*width + dv[k];
+    for (int y = std::max(0, -du[k]); y < std::min(height, height - du[k]); y++)
+    {
+      int x0 = std::max(0, -dv[k]);
+      int x1 = std::min(width, width - dv[k]);
+      for (int i = y*width + x0; i < y*width + x1; i++)
+      {
+        if (diag)
+        {
+          w[i] = float((D[i]*D[i]-w[i])/D[i]/D[i]);
+        }
+        else
+        {
+          w[i] = float(-w[i]/D[i]/D[i+off]);
+        }
+      }
+    }
+  }
+}
+
+void StencilMatrix::normalizeAffinity(const double* D, double shift)
+{
+  for (int k = 0; k < K; k++)
+  {
+    float* w = plane(k);
+    const bool diag = (du[k] == 0 && dv[k] == 0);
+    const int off = du[k]*width + dv[k];
+    for (int y = std::max(0, -du[k]); y < std::min(height, height - du[k]); y++)
+    {
+      int x0 = std::max(0, -dv[k]);
+      int x1 = std::min(width, width - dv[k]);
+      for (int i = y*width + x0; i < y*width + x1; i++)
+      {
+        w[i] = float(w[i]/D[i]/D[i+off] + (diag ? shift : 0.0));
+      }
+    }
+  }
+}
+
+int StencilMatrix::storedRow(int r, int* cols, float* vals) const
+{
+  int x = r % width;
+  int y = r / width;
+  int count = 0;
+  for (int k = 0; k < K; k++)
+  {
+    int xx = x + dv[k];
+    int yy = y + du[k];
+    if (xx < 0 || xx >= width || yy < 0 || yy >= height) {continue;}
+    cols[count] = yy*width + xx;
+    vals[count] = weights[(size_t)k*n + r];
+    count++;
+  }
+  return count;
+}
+
+void StencilMatrix::symmetrize()
+{
+  // pair plane k at pixel i with the opposite plane at pixel i+off(k)
+  for (int k = 0; k < K/2; k++)
+  {
+    float* w = plane(k);
+    float* wt = plane(K-1-k);
+    const int off = du[k]*width + dv[k];
+    for (int y = std::max(0, -du[k]); y < std::min(height, height - du[k]); y++)
+    {
+      int x0 = std::max(0, -dv[k]);
+      int x1 = std::min(width, width - dv[k]);
+      for (int i = y*width + x0; i < y*width + x1; i++)
+      {
+        float v_ij = w[i];
+        float v_ji = wt[i+off];
+        w[i] = 0.5f*(v_ij+v_ji);
+        wt[i+off] = 0.5f*(v_ij+v_ji);
+      }
+    }
+  }
+}
@@ -0,0 +1,100 @@
+#ifdef GPB_MPI
+
+#include <iostream>
+#include <string.h>
+#include "stripMatrix.h"
+
+StripMatrix::StripMatrix (MPI_Comm comm, int width, int top, int bottom,
+                          int n, int* row, int* col, float* values)
+{
+  this->n = n;
+  this->comm = comm;
+  this->width = width;
+  this->top = top;
+  this->bottom = bottom;
+  int rank, size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+  up = (rank > 0) ? rank-1 : MPI_PROC_NULL;
+  down = (rank+1 < size) ? rank+1 : MPI_PROC_NULL;
+  local = new SMatrix(n, row, col, values);
+  ext.resize((size_t)(top+bottom)*width + n);
+}
+
+StripMatrix::~StripMatrix ()
+{
+  delete local;
+}
+
+void StripMatrix::exchange(const double* in, double* ext) const
+{
+  // the neighbour above keeps our first rows as its bottom halo, the one
+  // below our last rows as its top halo
+  double* mid = ext + (size_t)top*width;
+  memcpy(mid, in, sizeof(double)*n);
+  MPI_Sendrecv(const_cast<double*>(in), top*width, MPI_DOUBLE, up, 0,
+               mid + n, bottom*width, MPI_DOUBLE, down, 0,
+               comm, MPI_STATUS_IGNORE);
+  MPI_Sendrecv(const_cast<double*>(in) + n - bottom*width, bottom*width, MPI_DOUBLE, down, 1,
+               ext, top*width, MPI_DOUBLE, up, 1,
+               comm, MPI_STATUS_IGNORE);
+}
+
+void StripMatrix::mult(const double* in, double* out) const
+{
+  exchange(in, &ext[0]);
+  local->mult(&ext[0], out);
+}
+
+void StripMatrix::rowSums(double* D) const
+{
+  local->rowSums(D);
+}
+
+void StripMatrix::normalize(const double* D)
+{
+  exchange(D, &ext[0]);
+  const int shift = top*width;
+  for (int r = 0; r < n; r++)
+  {
+    for (int i = local->row[r]; i < local->row[r+1]; i++)
+    {
+      int c = local->col[i];
+      float& v = local->values[i];
+      if (c == r + shift)
+      {
+        v = float((D[r]*D[r]-v)/D[r]/ext[c]);
+      }
+      else
+      {
+        v = float(-v/D[r]/ext[c]);
+      }
+    }
+  }
+}
+
+void StripMatrix::normalizeAffinity(const double* D, double shift)
+{
+  exchange(D, &ext[0]);
+  const int diag = top*width;
+  for (int r = 0; r < n; r++)
+  {
+    for (int i = local->row[r]; i < local->row[r+1]; i++)
+    {
+      int c = local->col[i];
+      local->values[i] = float(local->values[i]/D[r]/ext[c] + (c == r + diag ? shift : 0.0));
+    }
+  }
+}
+
+int StripMatrix::storedRow(int r, int* cols, float* vals) const
+{
+  return local->storedRow(r, cols, vals);
+}
+
+int StripMatrix::maxRowEntries() const
+{
+  return local->maxRowEntries();
+}
+
+#endif
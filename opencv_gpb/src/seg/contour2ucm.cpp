@@ -60,22 +60,26 @@ double contour_edge::length() const{
 
 namespace cv
 {
+  // the sigmoid learned on BSDS, which maps pb 0 to 0 and increases
+  float pb_normalize(float pb)
+  {
+    float beta1 = -2.7487, beta2 = 11.1189, beta3 = 0.0602;
+    float temp = 1/(1+exp(-(beta1+beta2*pb)));
+    temp = (temp-beta3)/(1-beta3);
+    if(temp < 0)
+      temp = 0;
+    if(temp > 1)
+      temp = 1;
+    return temp;
+  }
+
   void pb_normalize(const cv::Mat & input,
 		    cv::Mat & output)
   {
-    float beta1 = -2.7487, beta2 = 11.1189, beta3 = 0.0602;
     input.copyTo(output);
     for(size_t i=0; i<output.rows; i++)
-      for(size_t j=0; j<output.cols; j++){
-	float temp = output.at<float>(i,j);
-	temp = 1/(1+exp(beta1+beta2*temp));
-	temp = (temp-beta3)/(1-beta3);
-	if(temp < 0)
-	  temp = 0;
-	if(temp > 1)
-	  temp = 1;
-	output.at<float>(i,j) = temp;
-      }
+      for(size_t j=0; j<output.cols; j++)
+	output.at<float>(i,j) = pb_normalize(output.at<float>(i,j));
   }
   
   void neighbor_exists_2D(const int* pos,
@@ -779,7 +783,8 @@ namespace cv
   void contour2ucm(const cv::Mat & gPb,
 		   const vector<cv::Mat> & gPb_ori,
 		   cv::Mat & ucm,
-		   bool label)
+		   bool label,
+		   MergeTree * tree)
   { 
     bool flag = label ? DOUBLE_SIZE : SINGLE_SIZE;
     cv::Mat ws_wt8, ws_wt2, labels, ws_wt;
@@ -793,7 +798,10 @@ namespace cv
     clean_watersheds(ws_wt2, ws_wt2, labels);
 
     cv::copyMakeBorder(ws_wt2, ws_wt2, 0, 1, 0, 1, cv::BORDER_REFLECT);
-    cv::ucm_mean_pb(ws_wt2, labels, ucm, flag);
+    cv::ucm_mean_pb(ws_wt2, labels, ucm, flag, tree);
     pb_normalize(ucm, ucm);
+    if(tree)
+      for(size_t i=0; i<tree->saliency.size(); i++)
+	tree->saliency[i] = pb_normalize(float(tree->saliency[i]));
   }
 }
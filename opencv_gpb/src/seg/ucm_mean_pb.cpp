@@ -18,7 +18,7 @@ using namespace std;
 
 /*************************************************************/
 
-/******************************************************************************/   
+/******************************************************************************/
 
 #ifndef Order_node_h
 #define Order_node_h
@@ -29,16 +29,18 @@ class Order_node
     double energy;
     int region1;
     int region2;
+    int edge;
 
-    Order_node(){ energy = 0.0; region1 = 0; region2 = 0; }
-    
-	Order_node( const double& e, const int& rregion1, const int& rregion2 )
+    Order_node(){ energy = 0.0; region1 = 0; region2 = 0; edge = -1; }
+
+	Order_node( const double& e, const int& rregion1, const int& rregion2, const int& eedge )
     {
       energy = e;
       region1 = rregion1;
       region2 = rregion2;
+      edge = eedge;
     }
-    
+
 	~Order_node(){}
     // LEXICOGRAPHIC ORDER on priority queue: (energy,label)
 	bool operator < (const Order_node& x) const { return ( ( energy > x.energy ) ||(( energy == x.energy ) && (region1 > x.region1)) ||(( energy == x.energy ) && (region1 == x.region1)&& (region2 > x.region2))); }
@@ -46,149 +48,343 @@ class Order_node
 
 #endif
 
-/******************************************************************************/   
-
-#ifndef Neighbor_Region_h
-#define Neighbor_Region_h
-
-class Neighbor_Region
-{
-  public:
-    double energy;
-    double total_pb;
-    double bdry_length;
-    
-    Neighbor_Region()
-    	{ energy = 0.0; total_pb = 0.0; bdry_length = 0.0; }
-
-    Neighbor_Region(const Neighbor_Region& v)
-    	{ energy = v.energy; total_pb = v.total_pb; bdry_length = v.bdry_length; }
-
-    Neighbor_Region(const double& en, const double& tt, const double& bor )
-    {
-      energy = en;
-      total_pb = tt;
-      bdry_length = bor;
-     }
-
-    ~Neighbor_Region(){}
-
-};
-
-#endif
-
-/******************************************************************************/   
+/******************************************************************************/
 
 #ifndef Bdry_element_h
 #define Bdry_element_h
 
+// a boundary pixel, once per pair of regions (region1 < region2)
 class Bdry_element
 {
 public:
+   int region1;
+   int region2;
    int coord;
-   int cc_neigh;
-   
+
    Bdry_element(){}
-   
-   Bdry_element(const int& c, const int& v) { coord = c; cc_neigh = v;}
-   
-   Bdry_element(const Bdry_element& n) { coord = n.coord; cc_neigh = n.cc_neigh;}
-   
-   ~Bdry_element(){}
 
-   bool operator ==(const Bdry_element& n) const { return ( ( coord == n.coord) && ( cc_neigh == n.cc_neigh) ) ; }
-   // LEXICOGRAPHIC ORDER: (cc_neigh, coord)
-   bool operator < (const Bdry_element& n) const { return ( (cc_neigh < n.cc_neigh) || ((cc_neigh == n.cc_neigh) && ( coord < n.coord))); }
+   Bdry_element(const int& r1, const int& r2, const int& c) { region1 = r1; region2 = r2; coord = c; }
+
+   // LEXICOGRAPHIC ORDER: (region1, region2, coord)
+   bool operator < (const Bdry_element& n) const { return ( (region1 < n.region1) || ((region1 == n.region1) && ((region2 < n.region2) || ((region2 == n.region2) && (coord < n.coord))))); }
 
 };
 
 #endif
 
-/******************************************************************************/   
-
-#ifndef Region_h
-#define Region_h
-
-class Region
+/******************************************************************************/
+
+#ifndef Region_graph_h
+#define Region_graph_h
+
+// The region adjacency graph of compute_ucm, in flat arrays.
+//
+// Edge e joins the regions end[2e] and end[2e+1] and holds the pb summed
+// along their common boundary, its length and their mean.  Every region
+// threads the ends of its edges in a list (head, tail, next) that a merge
+// splices in O(1); the ends of dead edges (end -1) stay in the lists until
+// the next walk over them drops them.  Regions are a union-find forest in
+// which the father of a merge keeps its id.
+//
+// The boundary pixels of initial edge i are coord[first[i]..first[i+1]),
+// stored once.  A merged edge keeps the edges it absorbed as the leaves of
+// a tree (node, up), and the ucm a merge writes on its son's boundary goes
+// to raise[] of the tree nodes, to be pushed down to the pixels at the end.
+class Region_graph
 {
   public:
-    list<int> elements;
-    map<int, Neighbor_Region, less<int> > neighbors;
-    list<Bdry_element> boundary;
-    
-	Region(){}
-
-    Region(const int& l) { elements.push_back(l); }
+    vector<int> parent;
+    vector<int> head, tail;
+    vector<int> end, next;
+    vector<double> total_pb, bdry_length, energy;
+    vector<int> node;
+    vector<int> first, coord;
+    vector<int> up;
+    vector<double> raise;
+
+    Region_graph( double* local_boundaries, int* initial_partition, const int& totcc, const int& tx, const int& ty );
+
+    int edges() const { return (int)total_pb.size(); }
+    bool alive(const int& e) const { return end[2*e] >= 0; }
+    int find(int r) const { while (parent[r] != r) r = parent[r]; return r; }
+
+    void merge( const int& e, const int& son, const int& father, const double& saliency, vector<int>& mark, vector<int>& killed );
+    void draw( double* ucm );
+};
 
-    ~Region(){}
+Region_graph::Region_graph( double* local_boundaries, int* initial_partition, const int& totcc, const int& tx, const int& ty )
+{
+    parent.resize(totcc);
+    for (int c = 0; c < totcc; c++) parent[c] = c;
+    head.assign(totcc, -1);
+    tail.assign(totcc, -1);
+
+    // 	I. boundary pixels of every pair of regions, in coord order
+    vector<Bdry_element> bdry;
+    int vx[2] = { 1, 0 };
+    int vy[2] = { 0, 1 };
+    for (int p = 0; p < tx*ty; p++)
+    {
+      int xp = p%tx, yp = p/tx;
+      for (int v = 0; v < 2; v++)
+      {
+        int nxp = xp + vx[v], nyp = yp + vy[v], cnp = nxp + nyp*tx;
+        if ( (nyp < ty) && (nxp < tx) && (initial_partition[cnp] != initial_partition[p]) )
+        {
+          int a = initial_partition[p], b = initial_partition[cnp];
+          bdry.push_back(Bdry_element(min(a,b), max(a,b), ( xp + nxp + 1 ) + ( yp + nyp + 1 )*(2*tx+1)));
+        }
+      }
+    }
+    sort(bdry.begin(), bdry.end());
 
-    void merge( Region& r, int* labels, const int& label, double* ucm, const double& saliency, const int& son, const int& tx );
+    // 	II. one edge per pair
+    coord.resize(bdry.size());
+    for (size_t i = 0; i < bdry.size(); i++)
+    {
+      coord[i] = bdry[i].coord;
+      if ( (i == 0) || (bdry[i].region1 != bdry[i-1].region1) || (bdry[i].region2 != bdry[i-1].region2) )
+      {
+        int e = (int)first.size(), a = bdry[i].region1, b = bdry[i].region2;
+        first.push_back((int)i);
+        total_pb.push_back(0.0);
+        bdry_length.push_back(0.0);
+        end.push_back(a); end.push_back(b);
+        next.push_back(-1); next.push_back(-1);
+        for (int s = 0; s < 2; s++)
+        {
+          int r = end[2*e+s];
+          if (head[r] < 0) head[r] = 2*e+s; else next[tail[r]] = 2*e+s;
+          tail[r] = 2*e+s;
+        }
+      }
+      total_pb.back() += local_boundaries[coord[i]];
+      bdry_length.back()++;
+    }
+    first.push_back((int)bdry.size());
 
-};
+    energy.resize(edges());
+    node.resize(edges());
+    for (int e = 0; e < edges(); e++)
+    {
+      energy[e] = total_pb[e]/bdry_length[e];
+      node[e] = e;
+    }
+    up.assign(edges(), -1);
+    raise.assign(edges(), 0.0);
+}
 
-void Region::merge( Region& r, int* labels, const int& label, double* ucm, const double& saliency, const int& son, const int& tx )
+// merge son into father along their edge e; the edges of son that join
+// one of father's are added to killed
+void Region_graph::merge( const int& e, const int& son, const int& father, const double& saliency, vector<int>& mark, vector<int>& killed )
 {
-    /* 			I. BOUNDARY        */
+    //	I. the ucm rises to saliency all along son's boundary
+    for (int k = head[son]; k >= 0; k = next[k])
+      if ( alive(k/2) && (raise[node[k/2]] < saliency) ) raise[node[k/2]] = saliency;
 
-    // 	Ia. update father's boundary
-    list<Bdry_element>::iterator itrb, itrb2;
-    itrb = boundary.begin();
-    while ( itrb != boundary.end() )
+    end[2*e] = end[2*e+1] = -1;
+
+    //	II. drop dead ends from father's list and mark his neighbors
+    int last = -1;
+    for (int k = head[father]; k >= 0; k = next[k])
     {
-     		if( labels[(*itrb).cc_neigh] == son )
-         {
-            itrb2 = itrb;
-         	++itrb;
-            boundary.erase(itrb2);
-         }
-         else ++itrb;
+      if ( !alive(k/2) ) continue;
+      if (last < 0) head[father] = k; else next[last] = k;
+      last = k;
+      mark[end[k^1]] = k/2;
     }
+    if (last < 0) head[father] = -1; else next[last] = -1;
+    tail[father] = last;
 
-    //	Ib. move son's boundary to father
-    for( itrb = r.boundary.begin(); itrb != r.boundary.end(); ++itrb )
+    //	III. son's edges join father's, or move to him
+    for (int k = head[son]; k >= 0; )
     {
-      if (ucm[(*itrb).coord] < saliency ) ucm[(*itrb).coord] = saliency;
+      int nk = next[k];
+      int x = k/2;
+      if ( alive(x) )
+      {
+        int y = mark[end[k^1]];
+        if (y >= 0)
+        {
+          total_pb[y] += total_pb[x];
+          bdry_length[y] += bdry_length[x];
+          int z = (int)up.size();
+          up.push_back(-1);
+          raise.push_back(0.0);
+          up[node[x]] = z;
+          up[node[y]] = z;
+          node[y] = z;
+          end[2*x] = end[2*x+1] = -1;
+          killed.push_back(x);
+        }
+        else
+        {
+          end[k] = father;
+          next[k] = -1;
+          if (tail[father] < 0) head[father] = k; else next[tail[father]] = k;
+          tail[father] = k;
+        }
+      }
+      k = nk;
+    }
+    head[son] = tail[son] = -1;
+    parent[son] = father;
 
-      if ( labels[(*itrb).cc_neigh] != label )
-      	boundary.push_back( Bdry_element(*itrb) );
+    for (int k = head[father]; k >= 0; k = next[k]) mark[end[k^1]] = -1;
+}
 
+// write the raise of every boundary pixel into ucm
+void Region_graph::draw( double* ucm )
+{
+    for (int i = (int)up.size()-1; i >= 0; i--)
+      if ( (up[i] >= 0) && (raise[i] < raise[up[i]]) ) raise[i] = raise[up[i]];
+    for (int i = 0; i < (int)first.size()-1; i++)
+      for (int j = first[i]; j < first[i+1]; j++) ucm[coord[j]] = raise[i];
+}
+
+#endif
+
+/******************************************************************************/
+
+#ifndef Merging_queue_h
+#define Merging_queue_h
+
+// A binary heap of the live edges of a Region_graph, top first in the
+// order of Order_node, that knows where each edge sits so that its entry
+// is updated in place: one entry per edge instead of one per push.
+//
+// To pop the edges in the very order of a lazy queue, whose stale entries
+// come back to life when an edge returns to an earlier mean, every edge
+// also keeps the entries pushed for it that a lazy queue would still
+// hold (same regions, not yet passed by the pops), in a pool of linked
+// lists; its entry in the heap is the highest of them at its current mean.
+class Merging_queue
+{
+  public:
+    vector<Order_node> heap;
+    vector<int> pos;
+    vector<Order_node> pushed;
+    vector<int> pushed_next, pushed_head;
+    int free_pushed;
+    Order_node last;
+    bool popped;
+
+    Merging_queue( const int& edges )
+    {
+      pos.assign(edges, -1);
+      pushed_head.assign(edges, -1);
+      free_pushed = -1;
+      popped = false;
     }
-    r.boundary.erase( r.boundary.begin(), r.boundary.end() );
 
-     /* 			II. ELEMENTS      */
+    bool empty() const { return heap.empty(); }
+    const Order_node& top() const { return heap[0]; }
+    void pop() { last = heap[0]; popped = true; erase(heap[0].edge); }
+    void push( const Order_node& o );
+    void erase( const int& e );
 
-    for( list<int>::iterator p = r.elements.begin(); p != r.elements.end(); ++p ) labels[*p] = label;
-    elements.insert( elements.begin(), r.elements.begin(), r.elements.end() );
-    r.elements.erase( r.elements.begin(), r.elements.end() );
-    
+  private:
+    void place( int i );
+    void release( const int& g )
+    {
+      pushed_next[g] = free_pushed;
+      free_pushed = g;
+    }
+};
 
-    /* 			III. NEIGHBORS        */
+void Merging_queue::push( const Order_node& o )
+{
+    Order_node best = o;
+    bool known = false;
+    int* link = &pushed_head[o.edge];
+    while (*link >= 0)
+    {
+      int g = *link;
+      const Order_node& h = pushed[g];
+      bool same = ( (h.region1 == o.region1) && (h.region2 == o.region2) ) ||
+                  ( (h.region1 == o.region2) && (h.region2 == o.region1) );
+      if ( !same || ( popped && !(h < last) ) )
+      {
+        *link = pushed_next[g];
+        release(g);
+        continue;
+      }
+      if ( (h.energy == o.energy) && (best < h) ) best = h;
+      if ( (h.energy == o.energy) && (h.region1 == o.region1) ) known = true;
+      link = &pushed_next[g];
+    }
+    if (!known)
+    {
+      int g = free_pushed;
+      if (g < 0)
+      {
+        g = (int)pushed.size();
+        pushed.push_back(o);
+        pushed_next.push_back(-1);
+      }
+      else
+      {
+        free_pushed = pushed_next[g];
+        pushed[g] = o;
+      }
+      pushed_next[g] = pushed_head[o.edge];
+      pushed_head[o.edge] = g;
+    }
 
-    map<int,Neighbor_Region, less<int> >::iterator itr, itr2;
+    int i = pos[o.edge];
+    if (i < 0)
+    {
+      i = (int)heap.size();
+      heap.push_back(best);
+    }
+    else heap[i] = best;
+    place(i);
+}
 
-    // 	IIIa. remove inactive neighbors from father
-    itr = neighbors.begin();
-    while( itr != neighbors.end() )
+void Merging_queue::erase( const int& e )
+{
+    for (int g = pushed_head[e]; g >= 0; )
+    {
+      int n = pushed_next[g];
+      release(g);
+      g = n;
+    }
+    pushed_head[e] = -1;
+
+    int i = pos[e];
+    if (i < 0) return;
+    pos[e] = -1;
+    Order_node moved = heap.back();
+    heap.pop_back();
+    if (i < (int)heap.size())
     {
-  			if ( labels[(*itr).first] != (*itr).first )
-         {
-    			itr2 = itr;
-    			++itr;
-  	 			neighbors.erase(itr2);
-  			} else ++itr;
+      heap[i] = moved;
+      place(i);
     }
+}
 
-    // 	IIIb. remove inactive neighbors from son y and neighbors belonging to father
-    itr = r.neighbors.begin();
-    while ( itr != r.neighbors.end() )
+// sift the entry at i up or down to its place
+void Merging_queue::place( int i )
+{
+    Order_node o = heap[i];
+    while ( (i > 0) && (heap[(i-1)/2] < o) )
+    {
+      heap[i] = heap[(i-1)/2];
+      pos[heap[i].edge] = i;
+      i = (i-1)/2;
+    }
+    int n = (int)heap.size();
+    while (2*i+1 < n)
     {
-  	 		if ( ( labels[(*itr).first] != (*itr).first ) || ( labels[(*itr).first] == label ) )
-         {
-    			itr2 = itr;
-    			++itr;
-            r.neighbors.erase(itr2);
-         } else ++itr;
+      int c = 2*i+1;
+      if ( (c+1 < n) && (heap[c] < heap[c+1]) ) c++;
+      if ( !(o < heap[c]) ) break;
+      heap[i] = heap[c];
+      pos[heap[i].edge] = i;
+      i = c;
     }
+    heap[i] = o;
+    pos[o.edge] = i;
 }
 
 #endif
@@ -220,140 +416,119 @@ void complete_contour_map(double* ucm, const int& txc, const int& tyc)
 
 /***************************************************************************************************************************/
 void compute_ucm
-(	double* local_boundaries, int* initial_partition, const int& totcc, double* ucm, const int& tx, const int& ty)
+(	double* local_boundaries, int* initial_partition, const int& totcc, double* ucm, const int& tx, const int& ty, MergeTree* tree)
 {
   // I. INITIATE
-  int p,c;
-  int* labels = new int[totcc];
+  int p;
+  for( p = 0; p < (2*tx+1)*(2*ty+1); p++ ) ucm[p] = 0.0;
+
+  Region_graph G(local_boundaries, initial_partition, totcc, tx, ty);
+  vector<int> mark(totcc, -1);
 
-  for(c = 0; c < totcc; c++ )
+  // the tree node of every region
+  vector<int> top;
+  if (tree)
   {
-   labels[c] = c;
+    tree->leaves = totcc;
+    tree->parent.assign(totcc, -1);
+    tree->saliency.assign(totcc, 0.0);
+    tree->size.assign(totcc, 0);
+    for( p = 0; p < tx*ty; p++ ) tree->size[initial_partition[p]]++;
+    top.resize(totcc);
+    for (int c = 0; c < totcc; c++) top[c] = c;
   }
-   
+
   // II. ULTRAMETRIC
-  Region* R = new Region[totcc];
-  priority_queue<Order_node, vector<Order_node>, less<Order_node> > merging_queue;
-  double totalPb, totalBdry, dissimilarity;
-  int v;
+  Merging_queue merging_queue(G.edges());
+  vector<int> killed;
+  for (int e = 0; e < G.edges(); e++)
+    merging_queue.push(Order_node(G.energy[e], G.end[2*e], G.end[2*e+1], e));
 
-   for( p = 0; p < (2*tx+1)*(2*ty+1); p++ ) ucm[p] = 0.0;
-  
-   // INITIATE REGI0NS
-   for ( c = 0; c < totcc; c++ ) R[c] = Region(c);
-   
-   // INITIATE UCM
-  int vx[4] = { 1, 0, -1,  0};
-  int vy[4] = { 0, 1,  0, -1};
-  int nxp, nyp, cnp, xp, yp, label;
-  
-  for( p = 0; p < tx*ty; p++ )
-  {
-    xp = p%tx; yp = p/tx;
-    for( v = 0; v < 4; v++ )
-    {   
-      nxp =  xp + vx[v]; nyp = yp + vy[v]; cnp = nxp + nyp*tx;
-      if ( (nyp >= 0) && (nyp < ty) && (nxp < tx) && (nxp >= 0) && (initial_partition[cnp] != initial_partition[p]) )
-         R[initial_partition[p]].boundary.push_back(Bdry_element(( xp + nxp + 1 ) + ( yp + nyp + 1 )*(2*tx+1), initial_partition[cnp]));
-    }
-  }
- 
-    // INITIATE merging_queue
-   list<Bdry_element>::iterator itrb;
-   for ( c = 0; c < totcc; c++ )
-   {
-      R[c].boundary.sort();
-      
-      label = (*R[c].boundary.begin()).cc_neigh;
-      totalBdry = 0.0;
-      totalPb = 0.0;
-      
-      for ( itrb = R[c].boundary.begin(); itrb != R[c].boundary.end(); ++itrb ) 
-      {
-        if ((*itrb).cc_neigh == label)
-        {
-            totalBdry++;
-            totalPb += local_boundaries[(*itrb).coord];
-        }
-        else
-        {
-            R[c].neighbors[label] = Neighbor_Region(totalPb/totalBdry, totalPb, totalBdry);
-            if( label > c )   merging_queue.push(Order_node(totalPb/totalBdry, c, label));
-            label = (*itrb).cc_neigh;
-            totalBdry = 1.0;
-            totalPb = local_boundaries[(*itrb).coord];
-        }
-        
-      }
-      R[c].neighbors[label] = Neighbor_Region(totalPb/totalBdry, totalPb, totalBdry);
-      if( label > c )   merging_queue.push(Order_node(totalPb/totalBdry, c, label));
-    }
-      
-   
    //MERGING
    Order_node minor;
    int father, son;
-   map<int,Neighbor_Region,less<int> >::iterator itr;
    double current_energy = 0.0;
+   double dissimilarity;
 
    while ( !merging_queue.empty() )
    {
-   	minor = merging_queue.top(); merging_queue.pop();
-      if( (labels[minor.region1] == minor.region1) && (labels[minor.region2] == minor.region2)		&&
-      	 (minor.energy == R[minor.region1].neighbors[minor.region2].energy) )
+      minor = merging_queue.top(); merging_queue.pop();
+      int e = minor.edge;
+
+      if (current_energy <= minor.energy) current_energy = minor.energy;
+      else
       {
-         if (current_energy <= minor.energy) current_energy = minor.energy;
-         else
-         {
-            printf("\n ERROR : \n");
-            printf("\n current_energy = %f \n", current_energy);
-            printf("\n minor.energy = %f \n\n", minor.energy);
-            delete[] R; delete[] labels;
-	    cout<<" BUG: THIS IS NOT AN ULTRAMETRIC !!! "<<endl;;
-         } 
-         
-         dissimilarity =  R[minor.region1].neighbors[minor.region2].total_pb / R[minor.region1].neighbors[minor.region2].bdry_length ;
-         
-         if (minor.region1 < minor.region2)
-               { son = minor.region1; father = minor.region2; }
-         else
-               { son = minor.region2; father = minor.region1; }
-         
-         R[father].merge(R[son], labels, father, ucm, dissimilarity, son, tx);
-
-         // move and update neighbors
-         while ( R[son].neighbors.size() > 0 )
-         {
-             itr = R[son].neighbors.begin();
-
-             R[father].neighbors[(*itr).first].total_pb += (*itr).second.total_pb;
-             R[(*itr).first].neighbors[father].total_pb += (*itr).second.total_pb;
-
-             R[father].neighbors[(*itr).first].bdry_length += (*itr).second.bdry_length;
-             R[(*itr).first].neighbors[father].bdry_length += (*itr).second.bdry_length;
-
-             R[son].neighbors.erase(itr);
-         }
-
-         // update merging_queue
-         for (itr = R[father].neighbors.begin(); itr != R[father].neighbors.end(); ++itr )
-         {
-
-             dissimilarity = R[father].neighbors[(*itr).first].total_pb / R[father].neighbors[(*itr).first].bdry_length;
-             
-             merging_queue.push(Order_node(dissimilarity, (*itr).first, father));
-             R[father].neighbors[(*itr).first].energy = dissimilarity;
-             R[(*itr).first].neighbors[father].energy = dissimilarity;
-
-         }
-     }
+         printf("\n ERROR : \n");
+         printf("\n current_energy = %f \n", current_energy);
+         printf("\n minor.energy = %f \n\n", minor.energy);
+         cout<<" BUG: THIS IS NOT AN ULTRAMETRIC !!! "<<endl;;
+      }
+
+      dissimilarity = G.total_pb[e] / G.bdry_length[e];
+
+      if (minor.region1 < minor.region2)
+            { son = minor.region1; father = minor.region2; }
+      else
+            { son = minor.region2; father = minor.region1; }
+
+      killed.clear();
+      G.merge(e, son, father, dissimilarity, mark, killed);
+      for (size_t i = 0; i < killed.size(); i++) merging_queue.erase(killed[i]);
+
+      if (tree)
+      {
+         int n = (int)tree->parent.size();
+         tree->parent[top[son]] = tree->parent[top[father]] = n;
+         tree->parent.push_back(-1);
+         tree->saliency.push_back(dissimilarity);
+         tree->size.push_back(tree->size[top[son]] + tree->size[top[father]]);
+         top[father] = n;
+      }
+
+      // update merging_queue
+      for (int k = G.head[father]; k >= 0; k = G.next[k])
+      {
+          int x = k/2;
+          G.energy[x] = G.total_pb[x] / G.bdry_length[x];
+          merging_queue.push(Order_node(G.energy[x], G.end[k^1], father, x));
+      }
    }
 
+   G.draw(ucm);
    complete_contour_map(ucm, 2*tx+1, 2*ty+1 );
+}
 
-	delete[] R; delete[] labels;
+/*************************************************************************************************/
 
-   
+int MergeTree::cut(double thres, std::vector<int> & segment) const
+{
+  // top down, a node joins the segment of its parent if the parent's merge
+  // is below thres
+  int nodes = (int)parent.size();
+  vector<int> rep(nodes);
+  for(int i=nodes-1; i>=0; i--)
+    rep[i] = (parent[i] >= 0 && saliency[parent[i]] < thres) ? rep[parent[i]] : i;
+
+  vector<int> id(nodes, -1);
+  int count = 0;
+  segment.resize(leaves);
+  for(int i=0; i<leaves; i++){
+    if(id[rep[i]] < 0)
+      id[rep[i]] = count++;
+    segment[i] = id[rep[i]];
+  }
+  return count;
+}
+
+int MergeTree::cut(double thres, cv::Mat & labels) const
+{
+  vector<int> segment;
+  int count = cut(thres, segment);
+  labels.create(partition.rows, partition.cols, CV_32SC1);
+  for(int i=0; i<partition.rows; i++)
+    for(int j=0; j<partition.cols; j++)
+      labels.at<int>(i,j) = segment[partition.at<int>(i,j)];
+  return count;
 }
 
 /*************************************************************************************************/
@@ -361,7 +536,8 @@ void compute_ucm
 void ucm_mean_pb(const cv::Mat & input1,
 		 const cv::Mat & input2,
 		 cv::Mat & output,
-		 bool label)
+		 bool label,
+		 MergeTree * tree)
 {
   bool flag = label ? DOUBLE_SIZE : SINGLE_SIZE;
   double* local_boundaries = new double[input1.rows*input1.cols];
@@ -386,7 +562,13 @@ void ucm_mean_pb(const cv::Mat & input1,
     cout<<"ERROR : number of connected components < 0" <<endl;
   totcc++; 
   
-  compute_ucm(local_boundaries, initial_partition, totcc, ucm, input2.rows, input2.cols);
+  compute_ucm(local_boundaries, initial_partition, totcc, ucm, input2.rows, input2.cols, tree);
+  if(tree){
+    // saliencies in the units of output
+    for(size_t i=0; i<tree->saliency.size(); i++)
+      tree->saliency[i] = float(tree->saliency[i]);
+    input2.copyTo(tree->partition);
+  }
   
   if(flag)
     output = cv::Mat(input2.cols*2+1, input2.rows*2+1, CV_64FC1, ucm).t();
@@ -13,6 +13,7 @@
 */
 
 #include "uvt.h"
+#include "ucm_mean_pb.h"
 
 using namespace std;
 
@@ -196,4 +197,27 @@ namespace cv{
       labs.copyTo(labels);
     }
   }
+
+  void ucm2seg(const MergeTree & tree,
+	       cv::Mat & boundary,
+	       cv::Mat & labels,
+	       double thres)
+  {
+    tree.cut(thres, labels);
+    boundary = cv::Mat::zeros(labels.rows, labels.cols, CV_8UC1);
+
+    // as at the even points of the ucm: a pixel is on the boundary when
+    // two of the pixels around its top left corner are in different segments
+    for(int i=0; i<labels.rows; i++)
+      for(int j=0; j<labels.cols; j++){
+	int s = labels.at<int>(i,j);
+	bool b = (i>0 && labels.at<int>(i-1,j) != s) || (j>0 && labels.at<int>(i,j-1) != s);
+	if(i>0 && j>0){
+	  int d = labels.at<int>(i-1,j-1);
+	  b = b || d != labels.at<int>(i-1,j) || d != labels.at<int>(i,j-1);
+	}
+	if(b)
+	  boundary.at<uchar>(i,j) = 255;
+      }
+  }
 }
@@ -145,4 +145,38 @@ namespace cv
     // Matlab convention: 0 for boundaries, zone index start a 1
     regions = regions + 1;
   }
+
+  void
+  watershedGrid(const cv::Mat & image, 
+		int step, 
+		cv::Mat & regions)
+  {
+    cv::Mat imageu, image3;
+    image.convertTo(imageu, CV_8U);
+    cv::cvtColor(imageu, image3, CV_GRAY2RGB);
+
+    // seeds away from the frame, which cv::watershed overwrites
+    regions = cv::Mat::zeros(image.rows, image.cols, CV_32S);
+    int reach = step/3;
+    int index = 1;
+    for (int y = step/2; y < image.rows; y += step)
+      for (int x = step/2; x < image.cols; x += step)
+      {
+        int by = -1, bx = -1;
+        for (int yy = std::max(1, y - reach); yy <= std::min(image.rows - 2, y + reach); ++yy)
+          for (int xx = std::max(1, x - reach); xx <= std::min(image.cols - 2, x + reach); ++xx)
+            if (by < 0 || imageu.at<uchar>(yy, xx) < imageu.at<uchar>(by, bx))
+            {
+              by = yy;
+              bx = xx;
+            }
+        if (by >= 0)
+          regions.at<int>(by, bx) = index++;
+      }
+
+    cv::watershed(image3, regions);
+
+    // -1 on the lines becomes 0
+    regions = cv::max(regions, 0);
+  }
 }